@@ -0,0 +1,367 @@
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include "benchmark/benchmark.h"
+#include "AmdCompiler.h"
+
+using namespace amd::opencl_driver;
+
+static std::string joinf(const std::string& p1, const std::string& p2)
+{
+  std::string r;
+  if (!p1.empty()) { r += p1; r += "/"; }
+  r += p2;
+  return r;
+}
+
+static std::string LLVMBin()
+{
+  const char* llvmBin = getenv("LLVM_BIN");
+  return llvmBin ? llvmBin : "";
+}
+
+static std::string TestDir()
+{
+  const char* testDir = getenv("TEST_DIR");
+  return testDir ? testDir : "";
+}
+
+static CompilerFactory compilerFactory;
+
+static Compiler* NewCompiler(bool inProcess = true)
+{
+  Compiler* compiler = compilerFactory.CreateAMDGPUCompiler(LLVMBin());
+  compiler->SetInProcess(inProcess);
+  return compiler;
+}
+
+// Compiler owns all its data and temp files until destroyed, so long
+// running benchmarks recreate it periodically outside of measured time.
+static void Recycle(benchmark::State& state, std::unique_ptr<Compiler>& compiler, bool inProcess = true)
+{
+  static const size_t recyclePeriod = 1000;
+  if (state.iterations() % recyclePeriod != 0) { return; }
+  state.PauseTiming();
+  compiler.reset(NewCompiler(inProcess));
+  state.ResumeTiming();
+}
+
+static bool ReportError(benchmark::State& state, Compiler* compiler)
+{
+  std::cerr << compiler->Output() << std::endl;
+  state.SkipWithError("Compilation failed");
+  return false;
+}
+
+static const std::string simpleCl = "simple.cl";
+static const std::string externFunction1Cl = "extern_function1.cl";
+static const std::string externFunction2Cl = "extern_function2.cl";
+
+static std::vector<std::string> DefaultOptions()
+{
+  std::vector<std::string> options;
+  options.push_back("-cl-std=CL1.2");
+  return options;
+}
+
+static void BM_CreateCompiler(benchmark::State& state)
+{
+  for (auto _ : state) {
+    std::unique_ptr<Compiler> compiler(NewCompiler());
+    benchmark::DoNotOptimize(compiler.get());
+  }
+}
+BENCHMARK(BM_CreateCompiler);
+// One compiler per OpenCL program, for 100k programs.
+BENCHMARK(BM_CreateCompiler)->Iterations(100000)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_CreateCompiler)->Iterations(100000)->Threads(8)->Unit(benchmark::kMicrosecond);
+
+// Latency of the first compilation of a process, argument is 1 if warm-up
+// was started at application start, modeled as 1 s earlier. Only the first
+// compilation of a process is cold, so later runs in the same process are
+// reported as errors. opencl_driver_bench_first_compile target runs each
+// argument in its own process.
+static void BM_FirstCompile(benchmark::State& state)
+{
+  static bool compiled = false;
+  if (compiled) {
+    state.SkipWithError("Not the first compilation of the process, run with --benchmark_filter");
+    return;
+  }
+  compiled = true;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<Compiler> compiler(NewCompiler());
+    if (state.range(0)) { compiler->WarmUp(std::vector<std::string>(), DefaultOptions()); }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::vector<Data*> inputs;
+    inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    state.ResumeTiming();
+    if (!compiler->CompileAndLinkExecutable(inputs, out, DefaultOptions())) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_FirstCompile)->Arg(0)->Arg(1)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+static void BM_NewTempFile(benchmark::State& state)
+{
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  for (auto _ : state) {
+    Recycle(state, compiler);
+    benchmark::DoNotOptimize(compiler->NewTempFile(DT_LLVM_BC));
+  }
+}
+BENCHMARK(BM_NewTempFile);
+
+static void BM_NewBuffer(benchmark::State& state)
+{
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  for (auto _ : state) {
+    Recycle(state, compiler);
+    benchmark::DoNotOptimize(compiler->NewBuffer(DT_LLVM_BC));
+  }
+}
+BENCHMARK(BM_NewBuffer);
+
+static void BM_ToInputFile(benchmark::State& state)
+{
+  std::vector<char> data(state.range(0), 'x');
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  for (auto _ : state) {
+    Recycle(state, compiler);
+    Data* buf = compiler->NewBufferReference(DT_LLVM_BC, data.data(), data.size());
+    if (!buf->ToInputFile(0)) { state.SkipWithError("ToInputFile failed"); break; }
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ToInputFile)->Range(1 << 10, 16 << 20);
+
+static void BM_ReadOutputFile(benchmark::State& state)
+{
+  std::vector<char> data(state.range(0), 'x');
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  File* f = compiler->NewTempFile(DT_EXECUTABLE);
+  if (!f->WriteData(data.data(), data.size())) { state.SkipWithError("WriteData failed"); return; }
+  Buffer* buf = compiler->NewBuffer(DT_EXECUTABLE);
+  for (auto _ : state) {
+    if (!buf->ReadOutputFile(f)) { state.SkipWithError("ReadOutputFile failed"); break; }
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ReadOutputFile)->Range(1 << 10, 16 << 20);
+
+// Argument is 1 for in-process and 0 for out-of-process compilation.
+static void BM_CompileToLLVMBitcode(benchmark::State& state)
+{
+  bool inProcess = state.range(0);
+  std::unique_ptr<Compiler> compiler(NewCompiler(inProcess));
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+  std::vector<std::string> options = DefaultOptions();
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    if (!compiler->CompileToLLVMBitcode(inputs, out, options)) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_CompileToLLVMBitcode)->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond);
+
+static void BM_CompileAndLinkExecutable(benchmark::State& state)
+{
+  bool inProcess = state.range(0);
+  std::unique_ptr<Compiler> compiler(NewCompiler(inProcess));
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+  std::vector<std::string> options = DefaultOptions();
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    if (!compiler->CompileAndLinkExecutable(inputs, out, options)) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_CompileAndLinkExecutable)->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond);
+
+// In-process small-kernel compilation with reset of only changed LLVM
+// options (argument 0) or of all registered options (argument 1).
+static void BM_CompileAndLinkExecutable_OptionReset(benchmark::State& state)
+{
+  setenv("AMD_OCL_FULL_OPTION_RESET", state.range(0) ? "1" : "0", 1);
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+  std::vector<std::string> options = DefaultOptions();
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    if (!compiler->CompileAndLinkExecutable(inputs, out, options)) { ReportError(state, compiler.get()); break; }
+  }
+  unsetenv("AMD_OCL_FULL_OPTION_RESET");
+}
+BENCHMARK(BM_CompileAndLinkExecutable_OptionReset)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// In-process compilation with job plans reused across calls (argument 0)
+// or planned by clang driver for every call (argument 1).
+static void BM_CompileToLLVMBitcode_JobPlanning(benchmark::State& state)
+{
+  setenv("AMD_OCL_DISABLE_JOB_CACHE", state.range(0) ? "1" : "0", 1);
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+  std::vector<std::string> options = DefaultOptions();
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    if (!compiler->CompileToLLVMBitcode(inputs, out, options)) { ReportError(state, compiler.get()); break; }
+  }
+  unsetenv("AMD_OCL_DISABLE_JOB_CACHE");
+}
+BENCHMARK(BM_CompileToLLVMBitcode_JobPlanning)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// In-process compilation with frontend state freed (argument 0) or leaked
+// (argument 1). Iterations are limited, as memory is leaked.
+static void BM_CompileAndLinkExecutable_FastTeardown(benchmark::State& state)
+{
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  compiler->SetFastTeardown(state.range(0));
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+  std::vector<std::string> options = DefaultOptions();
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    if (!compiler->CompileAndLinkExecutable(inputs, out, options)) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_CompileAndLinkExecutable_FastTeardown)->Arg(0)->Arg(1)->Iterations(100)->Unit(benchmark::kMillisecond);
+
+static bool CompileExternFunctions(Compiler* compiler, std::vector<Data*>& bcs)
+{
+  for (const std::string& name : { externFunction1Cl, externFunction2Cl }) {
+    std::vector<Data*> inputs;
+    inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), name)));
+    Buffer* bc = compiler->NewBuffer(DT_LLVM_BC);
+    if (!compiler->CompileToLLVMBitcode(inputs, bc, DefaultOptions())) { return false; }
+    bcs.push_back(bc);
+  }
+  return true;
+}
+
+static void BM_LinkLLVMBitcode(benchmark::State& state)
+{
+  bool inProcess = state.range(0);
+  std::unique_ptr<Compiler> compiler(NewCompiler(inProcess));
+  std::vector<Data*> inputs;
+  if (!CompileExternFunctions(compiler.get(), inputs)) { ReportError(state, compiler.get()); return; }
+  std::vector<std::string> emptyOptions;
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    if (!compiler->LinkLLVMBitcode(inputs, out, emptyOptions)) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_LinkLLVMBitcode)->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond);
+
+// In-process link latency of small inputs, argument is 0 for a new LLVM
+// context per link, 1 for pooled contexts, 2 for resident libraries.
+static void BM_LinkLLVMBitcode_ContextPooling(benchmark::State& state)
+{
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  compiler->SetContextPooling(state.range(0) >= 1);
+  compiler->SetResidentLibraries(state.range(0) >= 2);
+  std::vector<Data*> inputs;
+  if (!CompileExternFunctions(compiler.get(), inputs)) { ReportError(state, compiler.get()); return; }
+  std::vector<std::string> emptyOptions;
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    if (!compiler->LinkLLVMBitcode(inputs, out, emptyOptions)) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_LinkLLVMBitcode_ContextPooling)->Arg(0)->Arg(1)->Arg(2)->Unit(benchmark::kMicrosecond);
+
+static void BM_CompileAndLinkExecutable_MultiInput(benchmark::State& state)
+{
+  bool inProcess = state.range(0);
+  std::unique_ptr<Compiler> compiler(NewCompiler(inProcess));
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), externFunction1Cl)));
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), externFunction2Cl)));
+  std::vector<std::string> options = DefaultOptions();
+  for (auto _ : state) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    if (!compiler->CompileAndLinkExecutable(inputs, out, options)) { ReportError(state, compiler.get()); break; }
+  }
+}
+BENCHMARK(BM_CompileAndLinkExecutable_MultiInput)->Arg(1)->Arg(0)->Unit(benchmark::kMillisecond);
+
+// Decompression of compressed artifacts, argument is data type of the
+// artifact compiled from simple.cl. Reports compression ratio.
+static void BM_DecompressArtifact(benchmark::State& state)
+{
+  DataType type = DataType(state.range(0));
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), simpleCl)));
+  Buffer* artifact = compiler->NewBuffer(type);
+  bool res = type == DT_EXECUTABLE ?
+    compiler->CompileAndLinkExecutable(inputs, artifact, DefaultOptions()) :
+    compiler->CompileToLLVMBitcode(inputs, artifact, DefaultOptions());
+  if (!res) { ReportError(state, compiler.get()); return; }
+  Buffer* compressed = compiler->NewBuffer(DT_INTERNAL);
+  if (!compiler->CompressArtifact(artifact, compressed)) { ReportError(state, compiler.get()); return; }
+  Buffer* out = compiler->NewBuffer(type);
+  for (auto _ : state) {
+    if (!compiler->DecompressArtifact(compressed, out)) { ReportError(state, compiler.get()); break; }
+  }
+  state.SetBytesProcessed(state.iterations() * artifact->Size());
+  state.counters["size"] = artifact->Size();
+  state.counters["compressed"] = compressed->Size();
+  state.counters["ratio"] = double(artifact->Size()) / compressed->Size();
+}
+BENCHMARK(BM_DecompressArtifact)->Arg(DT_EXECUTABLE)->Arg(DT_LLVM_BC);
+
+// Compact bitcode of src/test sources. First argument is index of source,
+// second is 1 to compile with debug info. Reports sizes of default, compact
+// and compact with summary index bitcode.
+static const struct {
+  const char* name;
+  const char* define;
+  const char* includeDir;
+} compactCorpus[] = {
+  { "simple.cl", 0, 0 },
+  { "extern_function1.cl", 0, 0 },
+  { "extern_function2.cl", 0, 0 },
+  { "defined.cl", "-DDEF=1", 0 },
+  { "includer.cl", 0, "include" },
+};
+
+static void BM_CompactBitcode(benchmark::State& state)
+{
+  std::unique_ptr<Compiler> compiler(NewCompiler());
+  std::vector<Data*> inputs;
+  inputs.push_back(compiler->NewFileReference(DT_CL, joinf(TestDir(), compactCorpus[state.range(0)].name)));
+  std::vector<std::string> options = DefaultOptions();
+  if (const char* define = compactCorpus[state.range(0)].define) { options.push_back(define); }
+  if (const char* includeDir = compactCorpus[state.range(0)].includeDir) {
+    options.push_back("-I" + joinf(TestDir(), includeDir));
+  }
+  if (state.range(1)) { options.push_back("-g"); }
+  Buffer* bc = compiler->NewBuffer(DT_LLVM_BC);
+  if (!compiler->CompileToLLVMBitcode(inputs, bc, options)) { ReportError(state, compiler.get()); return; }
+  compiler->SetCompactBitcode(true);
+  compiler->SetBitcodeSummary(true);
+  Buffer* summaryBc = compiler->NewBuffer(DT_LLVM_BC);
+  if (!compiler->CompileToLLVMBitcode(inputs, summaryBc, options)) { ReportError(state, compiler.get()); return; }
+  compiler->SetBitcodeSummary(false);
+  Buffer* compactBc = 0;
+  for (auto _ : state) {
+    compactBc = compiler->NewBuffer(DT_LLVM_BC);
+    if (!compiler->CompileToLLVMBitcode(inputs, compactBc, options)) { ReportError(state, compiler.get()); break; }
+  }
+  if (!compactBc) { return; }
+  state.counters["size"] = bc->Size();
+  state.counters["compact"] = compactBc->Size();
+  state.counters["summary"] = summaryBc->Size();
+  state.counters["reduction"] = 1.0 - double(compactBc->Size()) / bc->Size();
+}
+BENCHMARK(BM_CompactBitcode)
+  ->ArgsProduct({ { 0, 1, 2, 3, 4 }, { 0, 1 } })
+  ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
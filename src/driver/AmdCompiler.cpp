@@ -2,8 +2,18 @@
 #include <cstdio>
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
 
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/BuryPointer.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/CrashRecoveryContext.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/ADT/Triple.h"
@@ -35,6 +45,7 @@
 #include "llvm/Support/Error.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
@@ -48,13 +59,26 @@
 #include "clang/CodeGen/BackendUtil.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/ModuleSummaryIndex.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "lld/Common/Driver.h"
 
 // in-process assembler
@@ -76,6 +100,16 @@
 #include <sstream>
 #include <iostream>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <list>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
 
 #ifdef _WIN32
 #define NODRAWTEXT // avoids #define of DT_INTERNAL
@@ -89,6 +123,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif // __linux__
 #endif
 
 #define QUOTE(s) #s
@@ -132,6 +175,25 @@ const char* DataTypeExt(DataType type) {
   }
 }
 
+// Run fn(0) ... fn(n - 1) on at most maxThreads threads, 0 for hardware
+// concurrency. With one thread, fn runs on the calling thread.
+static void ParallelFor(size_t n, unsigned maxThreads, const std::function<void(size_t)>& fn) {
+  if (!maxThreads) { maxThreads = std::thread::hardware_concurrency(); }
+  size_t nthreads = std::min<size_t>(n, std::max(1u, maxThreads));
+  if (nthreads <= 1) {
+    for (size_t i = 0; i < n; ++i) { fn(i); }
+    return;
+  }
+  std::atomic_size_t next(0);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nthreads; ++t) {
+    threads.emplace_back([&]() {
+      for (size_t i = next++; i < n; i = next++) { fn(i); }
+    });
+  }
+  for (auto& t : threads) { t.join(); }
+}
+
 bool File::WriteData(const char* ptr, size_t size) {
   using namespace std;
   ofstream out(Name().c_str(), ios::out | ios::trunc | ios::binary);
@@ -161,6 +223,20 @@ public:
   ~TempFile();
 };
 
+// Anonymous in-memory file, named by /proc/self/fd path. The descriptor is
+// close-on-exec, so unrelated children do not keep it open. It is only
+// passed to children as redirect of their output: redirect path is opened
+// in the child before exec, where it still refers to the same file.
+class MemTempFile : public File {
+private:
+  int fd;
+
+public:
+  MemTempFile(Compiler* comp, DataType type, int fd_)
+    : File(comp, type, "/proc/self/fd/" + std::to_string(fd_)), fd(fd_) {}
+  ~MemTempFile();
+};
+
 class TempDir : public File {
 public:
   TempDir(Compiler* comp, const std::string& name)
@@ -216,6 +292,16 @@ bool Buffer::ReadOutputFile(File* f) {
   return true;
 }
 
+/*
+ * TempFiles provides names for temporary files and directories.
+ *
+ * Temp storage is configured with environment variables:
+ *   AMD_OCL_TMPDIR     - root directory (e.g. tmpfs mount), TMPDIR is used otherwise.
+ *   AMD_OCL_TMP_SHARDS - number of per-thread shard directories under root
+ *                        where compiler temp directories are created.
+ *   AMD_OCL_TMP_MEMFD  - use anonymous memory files for captured output of
+ *                        child processes (Linux only).
+ */
 class TempFiles {
 private:
 #ifdef _WIN32
@@ -223,15 +309,25 @@ private:
 #else // _WIN32
   const char* tempDir;
 #endif // _WIN32
+  unsigned shards;
+  bool memfd;
+  std::vector<std::string> shardDirs;
+  std::unique_ptr<std::once_flag[]> shardOnce;
+  // Whether shard directory was created, temp directories are created in
+  // root otherwise.
+  std::unique_ptr<char[]> shardCreated;
 
 public:
-  TempFiles() {
+  TempFiles() : shards(0), memfd(false) {
 #ifdef _WIN32
     if (!GetTempPath(MAX_PATH, tempDir)) {
       assert(!"GetTempPath failed");
     }
 #else
-    tempDir = getenv("TMPDIR");
+    tempDir = getenv("AMD_OCL_TMPDIR");
+    if (!tempDir) {
+      tempDir = getenv("TMPDIR");
+    }
 #ifdef P_tmpdir
     if (!tempDir) {
       tempDir = P_tmpdir;
@@ -240,10 +336,34 @@ public:
     if (!tempDir) {
       tempDir = "/tmp";
     }
+#if defined(__linux__) && defined(SYS_memfd_create)
+    const char* env = getenv("AMD_OCL_TMP_MEMFD");
+    memfd = env && env[0] != '0';
+#endif
 #endif
+    if (const char* env = getenv("AMD_OCL_TMP_SHARDS")) {
+      int n = atoi(env);
+      shards = std::min(n > 0 ? unsigned(n) : 0u, 1024u);
+    }
+    shardOnce.reset(new std::once_flag[shards ? shards : 1]);
+    shardCreated.reset(new char[shards ? shards : 1]());
+    for (unsigned i = 0; i < shards; ++i) {
+      shardDirs.push_back(NewTempName(0, "AMD_", 0) + "_s" + std::to_string(i));
+    }
   }
 
-  static const TempFiles& Instance() {
+  ~TempFiles() {
+    // Shard directories are only removed when empty.
+    for (const std::string& dir : shardDirs) {
+#ifdef _WIN32
+      RemoveDirectory(dir.c_str());
+#else // _WIN32
+      rmdir(dir.c_str());
+#endif // _WIN32
+    }
+  }
+
+  static TempFiles& Instance() {
     static TempFiles instance;
     return instance;
   }
@@ -256,14 +376,666 @@ public:
     static std::atomic_size_t counter(1);
     if (!dir) { dir = tempDir; }
     std::ostringstream name;
-    name << dir << "/" << prefix << getpid() << "_" << counter++;
+    name << dir << "/" << prefix;
+    if (pid) { name << getpid() << "_"; }
+    name << counter++;
     if (ext) { name << "." << ext; }
     return name.str();
   }
+
+  // Whether path contains a temp directory of this process, which compiler
+  // temp directories and shard directories are.
+  bool IsTempPath(StringRef path) const {
+    std::string prefix = std::string(tempDir) + "/AMD_" + std::to_string(getpid()) + "_";
+    return path.find(prefix) != StringRef::npos;
+  }
+
+  // Directory for temp directories created by the calling thread.
+  std::string ShardDir() {
+    if (!shards) { return tempDir; }
+    size_t shard = std::hash<std::thread::id>()(std::this_thread::get_id()) % shards;
+    const std::string& dir = shardDirs[shard];
+    char& created = shardCreated[shard];
+    std::call_once(shardOnce[shard], [&dir, &created]() {
+#ifdef _WIN32
+      created = CreateDirectory(dir.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else // _WIN32
+      created = mkdir(dir.c_str(), 0700) == 0 || errno == EEXIST;
+#endif // _WIN32
+    });
+    return created ? dir : std::string(tempDir);
+  }
+
+  // Returns descriptor of new anonymous memory file, or -1 if not supported.
+  int NewMemFile() const {
+#if defined(__linux__) && defined(SYS_memfd_create)
+    if (memfd) { return syscall(SYS_memfd_create, "amd_ocl", MFD_CLOEXEC); }
+#endif
+    return -1;
+  }
+};
+
+/*
+ * LLVMOptions tracks LLVM command line options changed by in-process jobs,
+ * so that only these are reset to defaults before the next job instead of
+ * every option registered by LLVM, clang and lld.
+ *
+ * Options are global, so tracking is process-wide. Options which cannot be
+ * identified by name cause full reset before the next job.
+ *
+ * In-process jobs hold the job lock across resetting options, parsing their
+ * options and execution, as clang backend and lld also parse options into
+ * the same global registry.
+ */
+class LLVMOptions {
+private:
+  std::mutex m;
+  std::mutex job;
+  std::set<cl::Option*> changed;
+  bool resetAll;
+
+  // Called with lock held.
+  void TrackLocked(StringRef option, bool registeredOnly) {
+    StringRef name = option.ltrim('-').split('=').first;
+    StringMap<cl::Option*>& registered = cl::getRegisteredOptions();
+    auto it = registered.find(name);
+    if (it != registered.end()) {
+      changed.insert(it->second);
+    } else if (!registeredOnly) {
+      resetAll = true;
+    }
+  }
+
+public:
+  LLVMOptions() : resetAll(false) {
+    // Set by clang backend from code generation options of each job.
+    TrackLocked("-debug-pass", true);
+    TrackLocked("-limit-float-precision", true);
+  }
+
+  static LLVMOptions& Instance() {
+    static LLVMOptions instance;
+    return instance;
+  }
+
+  std::unique_lock<std::mutex> LockJob() { return std::unique_lock<std::mutex>(job); }
+
+  // Track option in form -name[=value] as changed.
+  void Track(StringRef option) {
+    std::lock_guard<std::mutex> lock(m);
+    TrackLocked(option, false);
+  }
+
+  // Parse and track options, one option per argument.
+  bool Parse(ArrayRef<std::string> options, const char* overview) {
+    for (const std::string& option : options) {
+      Track(option);
+      const char* args[] = { "", option.c_str() };
+      if (!cl::ParseCommandLineOptions(2, args, overview)) { return false; }
+    }
+    return true;
+  }
+
+  // Reset every registered option to its default.
+  static void ResetAll() {
+    cl::ResetAllOptionOccurrences();
+    for (auto SC : cl::getRegisteredSubcommands()) {
+      for (auto &OM : SC->OptionsMap) {
+        cl::Option *O = OM.second;
+        O->setDefault();
+      }
+    }
+  }
+
+  void ResetToDefault() {
+    std::lock_guard<std::mutex> lock(m);
+    if (resetAll) {
+      ResetAll();
+      resetAll = false;
+      return;
+    }
+    for (cl::Option* O : changed) {
+      O->reset();
+    }
+  }
+};
+
+// Current resident memory of this process, in bytes, 0 if unknown.
+static size_t ResidentMemory() {
+#ifdef __linux__
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (!statm) { return 0; }
+  unsigned long size = 0, resident = 0;
+  int n = fscanf(statm, "%lu %lu", &size, &resident);
+  fclose(statm);
+  return n == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+#else // __linux__
+  return 0;
+#endif // __linux__
+}
+
+// Peak resident memory of this process since ResetPeakResidentMemory, or
+// of its waited for children, in bytes, 0 if unknown.
+static size_t PeakResidentMemory(bool children) {
+#ifdef __linux__
+  // Unlike ru_maxrss, VmHWM can be reset.
+  if (!children) {
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status) {
+      char line[128];
+      unsigned long hwm = 0;
+      while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %lu kB", &hwm) == 1) { break; }
+      }
+      fclose(status);
+      if (hwm) { return size_t(hwm) * 1024; }
+    }
+  }
+#endif // __linux__
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(children ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage) != 0) { return 0; }
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else // __APPLE__
+  return size_t(usage.ru_maxrss) * 1024;
+#endif // __APPLE__
+#else // _WIN32
+  return 0;
+#endif // _WIN32
+}
+
+// Reset peak resident memory of this process to its current resident
+// memory. Returns false if not supported, peak is then process lifetime peak.
+static bool ResetPeakResidentMemory() {
+#ifdef __linux__
+  FILE* clearRefs = fopen("/proc/self/clear_refs", "w");
+  if (!clearRefs) { return false; }
+  bool ok = fputs("5", clearRefs) >= 0;
+  return fclose(clearRefs) == 0 && ok;
+#else // __linux__
+  return false;
+#endif // __linux__
+}
+
+// Number of outermost calls being measured in this process.
+static std::atomic_uint measuredCalls(0);
+
+/*
+ * CompileScheduler admits compilations of all compilers in the process
+ * while their estimated memory fits in the budget set with
+ * CompilerFactory::SetMemoryBudget and their number fits in the slots set
+ * with CompilerFactory::SetMaxCompilations. One compilation is always
+ * admitted. Waiting compilations are admitted in order of priority, then
+ * arrival.
+ */
+class CompileScheduler {
+private:
+  std::mutex m;
+  std::condition_variable cv;
+  size_t budget;
+  size_t reserved;
+  unsigned slots;
+  unsigned running;
+  // Average of recently measured peak memory of compilations.
+  size_t estimate;
+  // Estimate does not go below the floor, as peak of compilation measures
+  // too low when the process had a higher peak which cannot be reset.
+  static const size_t minEstimate = 64 << 20;
+  // Tickets of waiting compilations for each priority, in order of arrival.
+  std::deque<uint64_t> waiting[CP_LAST + 1];
+  uint64_t nextTicket;
+
+  bool IsFirst(CompilePriority priority, uint64_t ticket) {
+    for (unsigned p = CP_LAST; p > unsigned(priority); --p) {
+      if (!waiting[p].empty()) { return false; }
+    }
+    return waiting[priority].front() == ticket;
+  }
+
+  bool Fits(size_t reserve) {
+    if (running == 0) { return true; }
+    return (budget == 0 || reserved + reserve <= budget) && (slots == 0 || running < slots);
+  }
+
+public:
+  CompileScheduler() : budget(0), reserved(0), slots(0), running(0), estimate(256 << 20), nextTicket(0) {
+    if (const char* env = getenv("AMD_OCL_MEMORY_BUDGET")) {
+      budget = size_t(strtoull(env, 0, 10)) << 20;
+    }
+    if (const char* env = getenv("AMD_OCL_MAX_COMPILATIONS")) {
+      slots = unsigned(strtoul(env, 0, 10));
+    }
+  }
+
+  static CompileScheduler& Instance() {
+    static CompileScheduler instance;
+    return instance;
+  }
+
+  void SetBudget(size_t budget_) {
+    std::lock_guard<std::mutex> lock(m);
+    budget = budget_;
+    cv.notify_all();
+  }
+
+  void SetSlots(unsigned slots_) {
+    std::lock_guard<std::mutex> lock(m);
+    slots = slots_;
+    cv.notify_all();
+  }
+
+  // Wait until compilation is admitted, returns memory reserved for it.
+  size_t Admit(CompilePriority priority) {
+    std::unique_lock<std::mutex> lock(m);
+    uint64_t ticket = nextTicket++;
+    waiting[priority].push_back(ticket);
+    size_t reserve = estimate;
+    cv.wait(lock, [&]() { return IsFirst(priority, ticket) && Fits(reserve); });
+    waiting[priority].pop_front();
+    ++running;
+    reserved += reserve;
+    // Next waiting compilation may fit too.
+    cv.notify_all();
+    return reserve;
+  }
+
+  // Whether compilation of given priority should yield to waiting one.
+  bool ShouldYield(CompilePriority priority) {
+    std::lock_guard<std::mutex> lock(m);
+    for (unsigned p = CP_LAST; p > unsigned(priority); --p) {
+      if (!waiting[p].empty()) { return true; }
+    }
+    return false;
+  }
+
+  // Suspend running compilation, keeping its memory reserved, as its
+  // memory stays in use.
+  void Suspend() {
+    std::lock_guard<std::mutex> lock(m);
+    --running;
+    cv.notify_all();
+  }
+
+  // Wait until suspended compilation may run again.
+  void Resume(CompilePriority priority) {
+    std::unique_lock<std::mutex> lock(m);
+    uint64_t ticket = nextTicket++;
+    waiting[priority].push_back(ticket);
+    cv.wait(lock, [&]() { return IsFirst(priority, ticket) && (running == 0 || slots == 0 || running < slots); });
+    waiting[priority].pop_front();
+    ++running;
+    cv.notify_all();
+  }
+
+  // Release memory reserved for compilation which used peak bytes.
+  void Release(size_t reserve, size_t peak) {
+    std::lock_guard<std::mutex> lock(m);
+    --running;
+    reserved -= reserve;
+    if (peak) {
+      estimate = (estimate * 3 + peak) / 4;
+      if (estimate < minEstimate) { estimate = minEstimate; }
+    }
+    cv.notify_all();
+  }
+};
+
+// Job of clang driver with arguments ready for in-process execution.
+struct PlannedJob {
+  std::string name;
+  std::vector<std::string> args;
+  ArgStringList argv;
+  // Index of input file argument, ~0 if none.
+  size_t inputArg = ~size_t(0);
+
+  void SetArgs() {
+    argv.clear();
+    for (const std::string& arg : args) { argv.push_back(arg.c_str()); }
+  }
+};
+
+/*
+ * JobPlan is a list of jobs planned by clang driver for some arguments,
+ * with input, output and driver temp file names replaced by slots. It is
+ * instantiated for each in-process compilation with the same arguments,
+ * so driver runs only once per distinct option set.
+ */
+struct JobPlan {
+  enum Slot {
+    SLOT_INPUT,
+    SLOT_OUTPUT,
+    SLOT_MAIN_FILE_NAME,
+    SLOT_TEMP,
+  };
+
+  struct Job {
+    std::string name;
+    std::vector<std::string> args;
+    // Argument index and slot, SLOT_TEMP + k for k-th temp file.
+    std::vector<std::pair<size_t, unsigned>> slots;
+  };
+
+  std::vector<Job> jobs;
+  std::vector<std::string> tempExts;
+  // Invocation parsed for the first clang job.
+  std::mutex m;
+  std::shared_ptr<const CompilerInvocation> invocation;
+};
+
+// Process-wide cache of job plans keyed by driver arguments. Least recently
+// used plan is evicted when the cache is full.
+class JobPlans {
+private:
+  typedef std::list<std::string> LRUList;
+  std::mutex m;
+  std::map<std::string, std::pair<std::shared_ptr<JobPlan>, LRUList::iterator>> plans;
+  // Keys from least to most recently used.
+  LRUList lru;
+  static const size_t maxPlans = 1024;
+
+public:
+  static JobPlans& Instance() {
+    static JobPlans instance;
+    return instance;
+  }
+
+  std::shared_ptr<JobPlan> Find(const std::string& key) {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = plans.find(key);
+    if (it == plans.end()) { return nullptr; }
+    lru.splice(lru.end(), lru, it->second.second);
+    return it->second.first;
+  }
+
+  void Add(const std::string& key, std::shared_ptr<JobPlan> plan) {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = plans.find(key);
+    if (it != plans.end()) {
+      it->second.first = plan;
+      lru.splice(lru.end(), lru, it->second.second);
+      return;
+    }
+    if (plans.size() >= maxPlans) {
+      plans.erase(lru.front());
+      lru.pop_front();
+    }
+    plans[key] = std::make_pair(plan, lru.insert(lru.end(), key));
+  }
+};
+
+// Process-wide registry of metrics of all compilers.
+class MetricsRegistry {
+private:
+  std::mutex m;
+  CompilerMetrics metrics;
+
+public:
+  static MetricsRegistry& Instance() {
+    static MetricsRegistry instance;
+    return instance;
+  }
+
+  void Call(const std::string& api, bool ok, double ms, uint64_t bytesIn, uint64_t bytesOut) {
+    std::lock_guard<std::mutex> lock(m);
+    ++metrics.calls[api];
+    if (!ok) { ++metrics.failures[api]; }
+    metrics.callLatency[api].Add(ms);
+    metrics.bytesIn += bytesIn;
+    metrics.bytesOut += bytesOut;
+  }
+
+  void Phase(const std::string& phase, double ms) {
+    std::lock_guard<std::mutex> lock(m);
+    metrics.phaseLatency[phase].Add(ms);
+  }
+
+  void Add(uint64_t CompilerMetrics::*counter, uint64_t n = 1) {
+    std::lock_guard<std::mutex> lock(m);
+    metrics.*counter += n;
+  }
+
+  void Cache(const std::string& cache, bool hit) {
+    std::lock_guard<std::mutex> lock(m);
+    ++(hit ? metrics.cacheHits : metrics.cacheMisses)[cache];
+  }
+
+  CompilerMetrics Snapshot() {
+    std::lock_guard<std::mutex> lock(m);
+    return metrics;
+  }
+};
+
+/*
+ * ContextPool keeps LLVM context of a thread for reuse by in-process links,
+ * together with modules of frequently linked libraries loaded in it. Context
+ * is recreated after maxUses links, as types and constants created by links
+ * accumulate in it.
+ */
+class ContextPool {
+private:
+  friend class PooledContext;
+  std::unique_ptr<LLVMContext> context;
+  // Declared after context, so modules are destroyed first.
+  std::map<std::string, std::unique_ptr<Module>> residents;
+  // Number of links which used each library, keyed by MD5 of contents.
+  std::map<std::string, unsigned> seen;
+  unsigned uses;
+  bool inUse;
+  static const unsigned maxUses = 256;
+  static const size_t maxResidents = 16;
+  static const size_t maxSeen = 1024;
+
+public:
+  ContextPool() : uses(0), inUse(false) {}
+
+  static ContextPool& ThreadInstance() {
+    thread_local ContextPool instance;
+    return instance;
+  }
+};
+
+// LLVM context for one link, taken from the pool of current thread if
+// pooling is requested and the pool is not in use.
+class PooledContext {
+private:
+  ContextPool* pool;
+  std::unique_ptr<LLVMContext> own;
+
+public:
+  PooledContext(bool pooling) : pool(nullptr) {
+    ContextPool& p = ContextPool::ThreadInstance();
+    if (!pooling || p.inUse) {
+      own.reset(new LLVMContext());
+      return;
+    }
+    pool = &p;
+    pool->inUse = true;
+    if (!pool->context || pool->uses >= ContextPool::maxUses) {
+      pool->residents.clear();
+      pool->context.reset(new LLVMContext());
+      pool->uses = 0;
+    }
+    ++pool->uses;
+  }
+
+  ~PooledContext() {
+    if (!pool) { return; }
+    // Diagnostic handler refers to compiler of this link.
+    pool->context->setDiagnosticHandler(std::make_unique<DiagnosticHandler>());
+    pool->inUse = false;
+  }
+
+  LLVMContext& Context() { return pool ? *pool->context : *own; }
+
+  // Leak context after crash of the link, its state is unknown. Pool
+  // creates a new context for the next link.
+  void Discard() {
+    if (!pool) {
+      own.release();
+      return;
+    }
+    for (auto& it : pool->residents) { it.second.release(); }
+    pool->residents.clear();
+    pool->context.release();
+    pool->uses = 0;
+  }
+
+  bool IsPooled() const { return pool != nullptr; }
+
+  // Context owned by this link, null if it is pooled.
+  std::unique_ptr<LLVMContext>& Own() { return own; }
+
+  // Module with given contents kept resident in pooled context, loaded from
+  // file name. Null if context is not pooled or the contents were not linked
+  // before, so they are not yet considered a library.
+  Module* Resident(StringRef contents, StringRef name, SMDiagnostic& error) {
+    if (!pool) { return nullptr; }
+    MD5 hash;
+    hash.update(contents);
+    MD5::MD5Result result;
+    hash.final(result);
+    std::string key = result.digest().str();
+    auto it = pool->residents.find(key);
+    MetricsRegistry::Instance().Cache("resident_libraries", it != pool->residents.end());
+    if (it != pool->residents.end()) { return it->second.get(); }
+    if (pool->seen.size() >= ContextPool::maxSeen) { pool->seen.clear(); }
+    if (pool->seen[key]++ == 0) { return nullptr; }
+    std::unique_ptr<Module> m = parseIR(MemoryBufferRef(contents, name), error, *pool->context);
+    if (!m) { return nullptr; }
+    if (pool->residents.size() >= ContextPool::maxResidents) { pool->residents.clear(); }
+    Module* resident = m.get();
+    pool->residents[key] = std::move(m);
+    return resident;
+  }
+};
+
+/*
+ * HeaderSets keeps embedded headers of in-process compilations in in-memory
+ * file systems, shared by compilations with the same header set. Headers of
+ * a set are in a virtual directory named by MD5 of their names and contents,
+ * so include options and job plans are the same for the same set.
+ */
+class HeaderSets {
+private:
+  std::mutex m;
+  std::map<std::string, IntrusiveRefCntPtr<vfs::InMemoryFileSystem>> sets;
+  static const size_t maxSets = 64;
+
+public:
+  static HeaderSets& Instance() {
+    static HeaderSets instance;
+    return instance;
+  }
+
+  // File system with given headers in directory dir. First header with
+  // a name is used, as with headers written to include directory.
+  IntrusiveRefCntPtr<vfs::InMemoryFileSystem> Find(ArrayRef<Data*> headers, std::string& dir) {
+    MD5 hash;
+    for (Data* header : headers) {
+      const char* ptr;
+      size_t size;
+      header->MemoryRef(ptr, size);
+      hash.update(header->Id());
+      hash.update(StringRef(reinterpret_cast<const char*>(&size), sizeof(size)));
+      hash.update(StringRef(ptr, size));
+    }
+    MD5::MD5Result result;
+    hash.final(result);
+    dir = "/amd-ocl-headers/" + result.digest().str().str();
+    std::lock_guard<std::mutex> lock(m);
+    auto it = sets.find(dir);
+    MetricsRegistry::Instance().Cache("header_sets", it != sets.end());
+    if (it != sets.end()) { return it->second; }
+    IntrusiveRefCntPtr<vfs::InMemoryFileSystem> fs(new vfs::InMemoryFileSystem());
+    for (Data* header : headers) {
+      const char* ptr;
+      size_t size;
+      header->MemoryRef(ptr, size);
+      fs->addFile(dir + "/" + header->Id(), 0, MemoryBuffer::getMemBufferCopy(StringRef(ptr, size), header->Id()));
+    }
+    if (sets.size() >= maxSets) { sets.clear(); }
+    sets[dir] = fs;
+    return fs;
+  }
+};
+
+// Records latency of compilation phase from construction to destruction.
+class PhaseTimer {
+private:
+  const char* phase;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  PhaseTimer(const char* phase_) : phase(phase_), start(std::chrono::steady_clock::now()) {}
+
+  ~PhaseTimer() {
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    MetricsRegistry::Instance().Phase(phase, ms);
+  }
 };
 
+// Size of data in memory or in file, 0 if unknown.
+static uint64_t DataSize(Data* data) {
+  const char* ptr;
+  size_t size;
+  if (data->MemoryRef(ptr, size)) { return size; }
+  // Data not in memory are files, their input file is themselves.
+  FileReference* file = data->ToInputFile(0);
+  uint64_t fileSize;
+  if (!file || sys::fs::file_size(file->Name(), fileSize)) { return 0; }
+  return fileSize;
+}
+
+// Initialize AMDGPU target once per process, with assembler parser and
+// printer if compilation is in-process.
+static void InitializeTarget(bool inProcess) {
+  static std::once_flag targetOnce;
+  static std::once_flag inProcessOnce;
+  std::call_once(targetOnce, []() {
+    LLVMInitializeAMDGPUTarget();
+    LLVMInitializeAMDGPUTargetInfo();
+    LLVMInitializeAMDGPUTargetMC();
+    LLVMInitializeAMDGPUDisassembler();
+  });
+  if (inProcess) {
+    std::call_once(inProcessOnce, []() {
+      LLVMInitializeAMDGPUAsmParser();
+      LLVMInitializeAMDGPUAsmPrinter();
+    });
+  }
+}
+
 class AMDGPUCompiler : public Compiler {
 private:
+  // Outermost compilation call of compiler is admitted by CompileScheduler
+  // and its statistics are measured.
+  class CallScope {
+  private:
+    AMDGPUCompiler* compiler;
+    bool outermost;
+    const char* api;
+    std::vector<Data*> outputs;
+    bool ok;
+    uint64_t bytesIn;
+    size_t reserve;
+    size_t startMemory;
+    size_t startPeak;
+    size_t startChildPeak;
+    unsigned startChildren;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration queueTime;
+
+  public:
+    CallScope(AMDGPUCompiler* compiler_, const char* api_, const std::vector<Data*>& inputs, ArrayRef<Data*> outputs_);
+    ~CallScope();
+    // Record result of the call, returns res.
+    bool Result(bool res) { ok = res; return res; }
+    // Let waiting compilation of higher priority run, then wait to be
+    // admitted again. Memory reserved for the call stays reserved.
+    void Yield();
+  };
+
   struct AMDGPUCompilerDiagnosticHandler : public DiagnosticHandler {
     AMDGPUCompiler *Compiler = nullptr;
 
@@ -316,6 +1088,8 @@ private:
     llvm::DebugCompressionType CompressDebugSections = llvm::DebugCompressionType::None;
     std::string MainFileName;
     std::string InputFile = "-";
+    // If given, used as input instead of InputFile.
+    std::unique_ptr<MemoryBuffer> InputBuffer;
     std::vector<std::string> LLVMArgs;
     std::string OutputPath = "-";
     unsigned OutputAsmVariant = 0;
@@ -342,10 +1116,9 @@ private:
 
   std::string output;
   llvm::raw_string_ostream OS;
+  // Created on first use, most compilers never report driver diagnostics.
   IntrusiveRefCntPtr<DiagnosticOptions> diagOpts;
-  TextDiagnosticPrinter* diagClient;
-  IntrusiveRefCntPtr<DiagnosticIDs> diagID;
-  DiagnosticsEngine diags;
+  std::unique_ptr<DiagnosticsEngine> diags;
   std::vector<Data*> datas;
   std::string llvmBin;
   std::string llvmLinkExe;
@@ -354,10 +1127,36 @@ private:
   LogLevel logLevel;
   bool printlog;
   bool keeptmp;
+  bool compactbc;
+  bool bcsummary;
+  bool fastteardown;
+  bool crashrecovery;
+  unsigned timeout;
+  // Deadline of the current call, if it has timeout.
+  bool hasDeadline;
+  std::chrono::steady_clock::time_point deadline;
+  bool timedOut;
+  bool contextpooling;
+  bool residentlibs;
+  bool lto;
+  unsigned parallelJobs;
+  unsigned callDepth;
+  // Scope of the outermost call, null in worker compilers.
+  CallScope* callScope;
+  CompilePriority priority;
+  std::thread warmUpThread;
+  // Set to skip warm-up targets not started yet.
+  std::shared_ptr<std::atomic_bool> warmUpCancel;
+  // Embedded headers overlaid on real file system for in-process frontend.
+  IntrusiveRefCntPtr<vfs::FileSystem> headerFS;
+  // Number of child processes run by this compiler.
+  unsigned children;
+  CompileStatistics stats;
   const std::string clangJobName = "clang";
   const std::string clangasJobName = "clang::as";
   const std::string linkerJobName = "amdgpu::Linker";
   const std::string clangDriverName = "clang Driver";
+  const std::string specPlaceholderPrefix = "__amd_ocl_spec_";
 
   template <typename T>
   inline T* AddData(T* d) { datas.push_back(d); return d; }
@@ -368,23 +1167,55 @@ private:
   ArgStringList GetJobArgsFitered(const Command& job);
   // Parse -mllvm options
   bool ParseLLVMOptions(const std::vector<std::string>& options);
-  bool PrepareCompiler(CompilerInstance& clang, const Command& job);
-  bool PrepareAssembler(AssemblerInvocation &Opts, const Command& job);
+  bool PrepareCompiler(CompilerInstance& clang, const PlannedJob& job, JobPlan* plan = nullptr);
+  bool PrepareAssembler(AssemblerInvocation &Opts, const PlannedJob& job);
+  // Plan jobs for driver arguments with given input and output names,
+  // reusing the plan of earlier call with the same arguments.
+  std::shared_ptr<JobPlan> PlanJobs(ArrayRef<const char*> args, const std::string& input,
+                                    const std::string& output, std::vector<PlannedJob>& jobs);
+  bool BuildJobPlan(const Compilation& C, const std::string& input, const std::string& output, JobPlan& plan);
   bool ExecuteCompiler(CompilerInstance& clang, BackendAction action);
+  // Run in-process job, under crash recovery if enabled. If job crashes,
+  // error is reported, crashed is set and false is returned. Job runs on
+  // its own thread with large stack unless ownStack is false.
+  bool RunJobSafely(const std::string& jobName, function_ref<bool()> job, bool& crashed, bool ownStack = true);
+  // Check deadline of the current call, reporting timeout once.
+  // Returns false if deadline has passed.
+  bool CheckDeadline();
+  // Waits for child process until deadline of the current call, killing
+  // it if deadline passes. Returns exit code of the child.
+  int WaitChild(const sys::ProcessInfo& PI);
+  // Called between passes of in-process jobs to abort them on timeout.
+  static void YieldCallback(LLVMContext* context, void* handle);
   bool ExecuteAssembler(AssemblerInvocation &Opts);
   bool CreateAssemblerInvocationFromArgs(AssemblerInvocation &Opts, ArrayRef<const char *> Argv);
   std::unique_ptr<raw_fd_ostream> GetAssemblerOutputStream(AssemblerInvocation &Opts, bool Binary);
   void InitDriver(std::unique_ptr<Driver>& driver);
+  DiagnosticsEngine& Diags();
   bool InvokeDriver(ArrayRef<const char*> args);
   bool InvokeTool(ArrayRef<const char*> args, const std::string& sToolName);
   void PrintOptions(ArrayRef<const char*> args, const std::string& sToolName, bool isInProcess);
   void PrintJobs(const JobList &jobs);
+  void PrintJobs(ArrayRef<PlannedJob> jobs);
   void PrintPhase(const std::string& phase, bool isInProcess);
   bool Return(bool retValue);
   void FlushLog();
   File* CompilerTempDir();
   bool IsVar(const std::string& sEnvVar, bool bVar);
   bool EmitLinkerError(LLVMContext &context, const Twine &message);
+  // Load and link files into new module, nullptr on error. If residents
+  // is not null, modules of libraries linked repeatedly are kept resident
+  // in its pooled context. If ready is set, each file is loaded after
+  // ready(i) returns true.
+  std::unique_ptr<Module> LinkModules(ArrayRef<const char*> files, LLVMContext& context, PooledContext* residents = nullptr,
+                                      const std::function<bool(size_t)>& ready = nullptr);
+  // Write module to file. For final outputs, compact bitcode and summary
+  // settings are applied.
+  bool WriteBitcode(Module& M, File* file, bool finalOutput = false);
+  // Apply compact bitcode and summary settings to DT_LLVM_BC output.
+  bool CompactBitcode(Data* output);
+  // Write module to output, compiling it with options if output is DT_EXECUTABLE.
+  bool WriteModule(Module& M, Data* output, const std::vector<std::string>& options);
   std::string JoinFileName(const std::string& p1, const std::string& p2);
 
   FileReference* ToInputFile(Data* input, File *parent);
@@ -393,10 +1224,29 @@ private:
 
   bool CompileToLLVMBitcode(Data* input, Data* output, const std::vector<std::string>& options);
 
+  // If finalOutput is false, output is intermediate and settings for LLVM
+  // Bitcode outputs are not applied.
+  bool CompileToLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool finalOutput);
+
+  // If ready is set, ready(i) waits until input i is written and returns
+  // false if it cannot be. In-process, each input is linked as soon as it
+  // is ready. If ltoLevel is not 0, linked module is optimized across
+  // translation units at that level.
+  bool LinkLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool finalOutput,
+                       const std::function<bool(size_t)>& ready = nullptr, unsigned ltoLevel = 0);
+
+  bool OptimizeLinkedBitcode(File* file, unsigned optLevel);
+
   bool CompileAndLinkExecutable(Data* input, Data* output, const std::vector<std::string>& options);
 
   bool DumpExecutableAsText(Buffer* exec, File* dump) override;
 
+  // Read contents of input, mb keeps them if input is not in memory.
+  bool ReadData(Data* input, std::unique_ptr<MemoryBuffer>& mb, StringRef& contents);
+
+  // Create compiler with the same settings to be used on worker thread.
+  AMDGPUCompiler* NewWorkerCompiler();
+
 public:
   AMDGPUCompiler(const std::string& llvmBin);
 
@@ -404,6 +1254,8 @@ public:
 
   const std::string& Output() override;
 
+  const CompileStatistics& Statistics() override { return stats; }
+
   FileReference* NewFileReference(DataType type, const std::string& path, File* parent = 0) override;
 
   File* NewFile(DataType type, const std::string& name, File* parent = 0) override;
@@ -422,6 +1274,20 @@ public:
 
   bool CompileAndLinkExecutable(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) override;
 
+  bool CompileAndLinkExecutables(const std::vector<Data*>& inputs, const std::vector<std::string>& targets, const std::vector<Data*>& outputs, const std::vector<std::string>& options) override;
+
+  bool CompileToSpecializableLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& placeholders, const std::vector<std::string>& options) override;
+
+  bool SpecializeLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& values, const std::vector<std::string>& options) override;
+
+  bool CompileAndLinkKernels(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& kernels, const std::vector<std::string>& options) override;
+
+  bool CompressArtifact(Data* input, Data* output) override;
+
+  bool DecompressArtifact(Data* input, Buffer* output) override;
+
+  void WarmUp(const std::vector<std::string>& targets, const std::vector<std::string>& options) override;
+
   void SetInProcess(bool binprocess = true) override;
 
   bool IsInProcess() override { return IsVar("AMD_OCL_IN_PROCESS", inprocess); }
@@ -437,6 +1303,46 @@ public:
   void SetLogLevel(LogLevel ll) override { logLevel = ll; }
 
   LogLevel GetLogLevel() override;
+
+  void SetCompactBitcode(bool bcompact = true) override { compactbc = bcompact; }
+
+  bool IsCompactBitcode() override { return IsVar("AMD_OCL_COMPACT_BITCODE", compactbc); }
+
+  void SetBitcodeSummary(bool bsummary = true) override { bcsummary = bsummary; }
+
+  bool IsBitcodeSummary() override { return IsVar("AMD_OCL_BITCODE_SUMMARY", bcsummary); }
+
+  void SetFastTeardown(bool bfastteardown = true) override { fastteardown = bfastteardown; }
+
+  bool IsFastTeardown() override { return IsVar("AMD_OCL_DISABLE_FREE", fastteardown); }
+
+  void SetContextPooling(bool bcontextpooling = true) override { contextpooling = bcontextpooling; }
+
+  bool IsContextPooling() override { return IsVar("AMD_OCL_CONTEXT_POOLING", contextpooling); }
+
+  void SetResidentLibraries(bool bresidentlibs = true) override { residentlibs = bresidentlibs; }
+
+  bool IsResidentLibraries() override { return IsVar("AMD_OCL_RESIDENT_LIBRARIES", residentlibs); }
+
+  void SetCrashRecovery(bool bcrashrecovery = true) override { crashrecovery = bcrashrecovery; }
+
+  bool IsCrashRecovery() override { return IsVar("AMD_OCL_CRASH_RECOVERY", crashrecovery); }
+
+  void SetTimeout(unsigned ms) override { timeout = ms; }
+
+  unsigned GetTimeout() override;
+
+  void SetPriority(CompilePriority priority_) override { priority = priority_; }
+
+  CompilePriority GetPriority() override;
+
+  void SetLinkTimeOptimization(bool blto = true) override { lto = blto; }
+
+  bool IsLinkTimeOptimization() override { return IsVar("AMD_OCL_LINK_TIME_OPTIMIZATION", lto); }
+
+  void SetParallelJobs(unsigned n) override { parallelJobs = n; }
+
+  unsigned GetParallelJobs() override;
 };
 
 TempFile::~TempFile() {
@@ -444,6 +1350,10 @@ TempFile::~TempFile() {
   std::remove(Name().c_str());
 }
 
+MemTempFile::~MemTempFile() {
+  sys::Process::SafelyCloseFileDescriptor(fd);
+}
+
 TempDir::~TempDir() {
   if (compiler->IsKeepTmp()) { return; }
 #ifdef _WIN32
@@ -453,6 +1363,66 @@ TempDir::~TempDir() {
 #endif // _WIN32
 }
 
+AMDGPUCompiler::CallScope::CallScope(AMDGPUCompiler* compiler_, const char* api_, const std::vector<Data*>& inputs, ArrayRef<Data*> outputs_)
+  : compiler(compiler_), outermost(compiler->callDepth++ == 0), api(api_), ok(false), bytesIn(0) {
+  if (!outermost) { return; }
+  outputs.assign(outputs_.begin(), outputs_.end());
+  for (Data* input : inputs) { bytesIn += DataSize(input); }
+  // Call runs concurrently with warm-up of the current target, others are
+  // skipped.
+  if (compiler->warmUpCancel) { *compiler->warmUpCancel = true; }
+  compiler->timedOut = false;
+  unsigned timeout = compiler->GetTimeout();
+  compiler->hasDeadline = timeout != 0;
+  // Time waiting for admission counts to the timeout.
+  start = std::chrono::steady_clock::now();
+  compiler->deadline = start + std::chrono::milliseconds(timeout);
+  reserve = CompileScheduler::Instance().Admit(compiler->GetPriority());
+  queueTime = std::chrono::steady_clock::now() - start;
+  compiler->callScope = this;
+  // Peak is reset only when no other call is measured, as it is
+  // process-wide. Overlapping calls then measure the peak of all of them.
+  if (measuredCalls++ == 0) { ResetPeakResidentMemory(); }
+  startMemory = ResidentMemory();
+  startPeak = PeakResidentMemory(false);
+  startChildPeak = PeakResidentMemory(true);
+  startChildren = compiler->children;
+}
+
+void AMDGPUCompiler::CallScope::Yield() {
+  CompileScheduler& scheduler = CompileScheduler::Instance();
+  CompilePriority priority = compiler->GetPriority();
+  if (!scheduler.ShouldYield(priority)) { return; }
+  std::chrono::steady_clock::time_point yieldStart = std::chrono::steady_clock::now();
+  scheduler.Suspend();
+  scheduler.Resume(priority);
+  queueTime += std::chrono::steady_clock::now() - yieldStart;
+}
+
+AMDGPUCompiler::CallScope::~CallScope() {
+  --compiler->callDepth;
+  if (!outermost) { return; }
+  compiler->callScope = nullptr;
+  CompileStatistics& stats = compiler->stats;
+  stats = CompileStatistics();
+  stats.wallTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  stats.queueTime = std::chrono::duration<double, std::milli>(queueTime).count();
+  stats.compileTime = stats.wallTime - stats.queueTime;
+  size_t peak = PeakResidentMemory(false);
+  --measuredCalls;
+  size_t end = peak > startPeak ? peak : ResidentMemory();
+  stats.peakMemory = end > startMemory ? end - startMemory : 0;
+  if (compiler->children != startChildren) {
+    stats.childPeakMemory = std::max(PeakResidentMemory(true), startChildPeak);
+  }
+  CompileScheduler::Instance().Release(reserve, stats.peakMemory + stats.childPeakMemory);
+  uint64_t bytesOut = 0;
+  if (ok) {
+    for (Data* output : outputs) { bytesOut += DataSize(output); }
+  }
+  MetricsRegistry::Instance().Call(api, ok, stats.wallTime, bytesIn, bytesOut);
+}
+
 File* AMDGPUCompiler::CompilerTempDir() {
   if (!compilerTempDir) { compilerTempDir = NewTempDir(); }
   return compilerTempDir;
@@ -460,10 +1430,15 @@ File* AMDGPUCompiler::CompilerTempDir() {
 
 void AMDGPUCompiler::SetInProcess(bool binprocess) {
   inprocess = binprocess;
-  if (IsInProcess()) {
-    LLVMInitializeAMDGPUAsmParser();
-    LLVMInitializeAMDGPUAsmPrinter();
+  InitializeTarget(IsInProcess());
+}
+
+DiagnosticsEngine& AMDGPUCompiler::Diags() {
+  if (!diags) {
+    diagOpts = new DiagnosticOptions();
+    diags.reset(new DiagnosticsEngine(new DiagnosticIDs(), &*diagOpts, new TextDiagnosticPrinter(OS, &*diagOpts)));
   }
+  return *diags;
 }
 
 std::string AMDGPUCompiler::JoinFileName(const std::string& p1, const std::string& p2) {
@@ -485,7 +1460,7 @@ AMDGPUCompiler::GetAssemblerOutputStream(AssemblerInvocation &Opts, bool Binary)
   std::error_code EC;
   auto Out = std::make_unique<raw_fd_ostream>(Opts.OutputPath, EC, (Binary ? sys::fs::F_None : sys::fs::F_Text));
   if (EC) {
-    diags.Report(diag::err_fe_unable_to_open_output) << Opts.OutputPath << EC.message();
+    Diags().Report(diag::err_fe_unable_to_open_output) << Opts.OutputPath << EC.message();
     return nullptr;
   }
   return Out;
@@ -500,12 +1475,12 @@ bool AMDGPUCompiler::CreateAssemblerInvocationFromArgs(AssemblerInvocation &Opts
   InputArgList Args = OptTbl.ParseArgs(Argv, MissingArgIndex, MissingArgCount, IncludedFlagsBitmask);
   // Check for missing argument error.
   if (MissingArgCount) {
-    diags.Report(diag::err_drv_missing_argument) << Args.getArgString(MissingArgIndex) << MissingArgCount;
+    Diags().Report(diag::err_drv_missing_argument) << Args.getArgString(MissingArgIndex) << MissingArgCount;
     Success = false;
   }
   // Issue errors on unknown arguments.
   for (const Arg *A : Args.filtered(OPT_UNKNOWN)) {
-    diags.Report(diag::err_drv_unknown_argument) << A->getAsString(Args);
+    Diags().Report(diag::err_drv_unknown_argument) << A->getAsString(Args);
     Success = false;
   }
   // Construct the invocation.
@@ -537,7 +1512,7 @@ bool AMDGPUCompiler::CreateAssemblerInvocationFromArgs(AssemblerInvocation &Opts
     }
   }
   Opts.RelaxELFRelocations = Args.hasArg(OPT_mrelax_relocations);
-  Opts.DwarfVersion = getLastArgIntValue(Args, OPT_dwarf_version_EQ, 2, diags);
+  Opts.DwarfVersion = getLastArgIntValue(Args, OPT_dwarf_version_EQ, 2, Diags());
   Opts.DwarfDebugFlags = Args.getLastArgValue(OPT_dwarf_debug_flags);
   Opts.DwarfDebugProducer = Args.getLastArgValue(OPT_dwarf_debug_producer);
   Opts.DebugCompilationDir = Args.getLastArgValue(OPT_fdebug_compilation_dir);
@@ -550,7 +1525,7 @@ bool AMDGPUCompiler::CreateAssemblerInvocationFromArgs(AssemblerInvocation &Opts
         Opts.InputFile = A->getValue();
         First = false;
       } else {
-        diags.Report(diag::err_drv_unknown_argument) << A->getAsString(Args);
+        Diags().Report(diag::err_drv_unknown_argument) << A->getAsString(Args);
         Success = false;
       }
     }
@@ -565,14 +1540,14 @@ bool AMDGPUCompiler::CreateAssemblerInvocationFromArgs(AssemblerInvocation &Opts
       .Case("obj", AssemblerInvocation::FT_Obj)
       .Default(~0U);
     if (OutputType == ~0U) {
-      diags.Report(diag::err_drv_invalid_value) << A->getAsString(Args) << Name;
+      Diags().Report(diag::err_drv_invalid_value) << A->getAsString(Args) << Name;
       Success = false;
     } else {
       Opts.OutputType = AssemblerInvocation::FileType(OutputType);
     }
   }
   // Transliterate Options
-  Opts.OutputAsmVariant = getLastArgIntValue(Args, OPT_output_asm_variant, 0, diags);
+  Opts.OutputAsmVariant = getLastArgIntValue(Args, OPT_output_asm_variant, 0, Diags());
   Opts.ShowEncoding = Args.hasArg(OPT_show_encoding);
   Opts.ShowInst = Args.hasArg(OPT_show_inst);
   // Assemble Options
@@ -590,16 +1565,20 @@ bool AMDGPUCompiler::ExecuteAssembler(AssemblerInvocation &Opts) {
   std::string Error;
   const Target *TheTarget = TargetRegistry::lookupTarget(Opts.Triple, Error);
   if (!TheTarget) {
-    return diags.Report(diag::err_target_unknown_triple) << Opts.Triple;
+    return Diags().Report(diag::err_target_unknown_triple) << Opts.Triple;
   }
-  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFileOrSTDIN(Opts.InputFile);
-  if (std::error_code EC = Buffer.getError()) {
-    Error = EC.message();
-    return diags.Report(diag::err_fe_error_reading) << Opts.InputFile;
+  std::unique_ptr<MemoryBuffer> Input = std::move(Opts.InputBuffer);
+  if (!Input) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFileOrSTDIN(Opts.InputFile);
+    if (std::error_code EC = Buffer.getError()) {
+      Error = EC.message();
+      return Diags().Report(diag::err_fe_error_reading) << Opts.InputFile;
+    }
+    Input = std::move(*Buffer);
   }
   SourceMgr SrcMgr;
   // Tell SrcMgr about this buffer, which is what the parser will pick up.
-  SrcMgr.AddNewSourceBuffer(std::move(*Buffer), SMLoc());
+  SrcMgr.AddNewSourceBuffer(std::move(Input), SMLoc());
   // Record the location of the include directories so that the lexer can find it later.
   SrcMgr.setIncludeDirs(Opts.IncludePaths);
   std::unique_ptr<MCRegisterInfo> MRI(TheTarget->createMCRegInfo(Opts.Triple));
@@ -685,7 +1664,7 @@ bool AMDGPUCompiler::ExecuteAssembler(AssemblerInvocation &Opts) {
   MCTargetOptions Options;
   std::unique_ptr<MCTargetAsmParser> TAP(TheTarget->createMCAsmParser(*STI, *Parser, *MCII, Options));
   if (!TAP) {
-    Failed = diags.Report(diag::err_target_unknown_triple) << Opts.Triple;
+    Failed = Diags().Report(diag::err_target_unknown_triple) << Opts.Triple;
   }
   // Set values for symbols, if any.
   for (auto &S : Opts.SymbolDefs) {
@@ -713,20 +1692,87 @@ bool AMDGPUCompiler::ExecuteAssembler(AssemblerInvocation &Opts) {
   return Failed;
 }
 
+#ifndef NDEBUG
+// Crash in-process clang jobs on purpose, to test crash recovery.
+static cl::opt<bool> CrashJobForTesting("amd-ocl-crash-job", cl::Hidden, cl::init(false),
+                                        cl::desc("Crash in-process clang jobs (for testing)"));
+#endif // NDEBUG
+
+/*
+ * CrashRecoveryScope enables LLVM crash recovery while any job runs under it.
+ * Crash recovery installs process-wide handlers of SIGSEGV, SIGBUS and other
+ * crash signals, replacing handlers of the host application, so these are
+ * restored when the last job under crash recovery finishes.
+ */
+class CrashRecoveryScope {
+private:
+  static std::mutex m;
+  static unsigned count;
+
+public:
+  CrashRecoveryScope() {
+    std::lock_guard<std::mutex> lock(m);
+    if (count++ == 0) { CrashRecoveryContext::Enable(); }
+  }
+
+  ~CrashRecoveryScope() {
+    std::lock_guard<std::mutex> lock(m);
+    if (--count == 0) { CrashRecoveryContext::Disable(); }
+  }
+};
+
+std::mutex CrashRecoveryScope::m;
+unsigned CrashRecoveryScope::count = 0;
+
 bool AMDGPUCompiler::ExecuteCompiler(CompilerInstance& clang, BackendAction action) {
+  // Action creates its own LLVM context, unless deadline is checked
+  // between passes.
+  std::unique_ptr<LLVMContext> context;
+  if (hasDeadline) {
+    context.reset(new LLVMContext());
+    context->setYieldCallback(YieldCallback, this);
+  }
   std::unique_ptr<CodeGenAction> Act;
   switch (action) {
     case Backend_EmitBC:
-      Act = std::unique_ptr<CodeGenAction>(new EmitBCAction());
+      Act = std::unique_ptr<CodeGenAction>(new EmitBCAction(context.get()));
       break;
     case Backend_EmitObj:
-      Act = std::unique_ptr<CodeGenAction>(new EmitObjAction());
+      Act = std::unique_ptr<CodeGenAction>(new EmitObjAction(context.get()));
       break;
     default: { return false; }
   }
   if (!Act.get()) { return false; }
-  if (!clang.ExecuteAction(*Act)) { return false; }
-  return true;
+#ifndef NDEBUG
+  if (CrashJobForTesting) { LLVM_BUILTIN_TRAP; }
+#endif // NDEBUG
+  bool res = clang.ExecuteAction(*Act);
+  // Action owns LLVM context and module.
+  if (clang.getFrontendOpts().DisableFree) {
+    BuryPointer(std::move(Act));
+    BuryPointer(std::move(context));
+  }
+  return res;
+}
+
+bool AMDGPUCompiler::RunJobSafely(const std::string& jobName, function_ref<bool()> job, bool& crashed, bool ownStack) {
+  crashed = false;
+  if (!CheckDeadline()) { return false; }
+  if (!IsCrashRecovery() && !hasDeadline) { return job(); }
+  // Stack size clang uses for compilations on threads.
+  static const unsigned jobStackSize = 8 << 20;
+  CrashRecoveryScope recovery;
+  CrashRecoveryContext CRC;
+  bool res = false;
+  auto run = [&]() { res = job(); };
+  crashed = ownStack ? !CRC.RunSafelyOnThread(run, jobStackSize) : !CRC.RunSafely(run);
+  if (crashed) {
+    // Job aborted on timeout is reported by CheckDeadline.
+    if (timedOut) { return false; }
+    OS << "ERROR: In-process job '" << jobName << "' crashed.\n";
+    return false;
+  }
+  return res;
 }
 
 void AMDGPUCompiler::InitDriver(std::unique_ptr<Driver>& driver) {
@@ -761,46 +1807,182 @@ ArgStringList AMDGPUCompiler::GetJobArgsFitered(const Command& job) {
 }
 
 bool AMDGPUCompiler::ParseLLVMOptions(const std::vector<std::string>& options) {
-  if (options.empty()) { return true; }
-  std::vector<const char*> args;
-  for (auto A : options) {
-    args.push_back("");
-    args.push_back(A.c_str());
-    if (!cl::ParseCommandLineOptions(args.size(), &args[0], "-mllvm options parsing")) { return false; }
-    args.clear();
-  }
-  return true;
+  return LLVMOptions::Instance().Parse(options, "-mllvm options parsing");
 }
 
 void AMDGPUCompiler::ResetOptionsToDefault() {
-  cl::ResetAllOptionOccurrences();
-  for (auto SC : cl::getRegisteredSubcommands()) {
-    for (auto &OM : SC->OptionsMap) {
-      cl::Option *O = OM.second;
-      O->setDefault();
-    }
+  if (IsVar("AMD_OCL_FULL_OPTION_RESET", false)) {
+    LLVMOptions::ResetAll();
+    return;
   }
+  LLVMOptions::Instance().ResetToDefault();
 }
 
-bool AMDGPUCompiler::PrepareCompiler(CompilerInstance& clang, const Command& job) {
+bool AMDGPUCompiler::PrepareCompiler(CompilerInstance& clang, const PlannedJob& job, JobPlan* plan) {
   clang.createDiagnostics();
   if (!clang.hasDiagnostics()) { return false; }
+  if (headerFS) {
+    IntrusiveRefCntPtr<vfs::OverlayFileSystem> overlay(new vfs::OverlayFileSystem(vfs::getRealFileSystem()));
+    overlay->pushOverlay(headerFS);
+    clang.createFileManager(overlay);
+  }
   ResetOptionsToDefault();
-  const ArgStringList args = GetJobArgsFitered(job);
-  if (!CompilerInvocation::CreateFromArgs(clang.getInvocation(), args,
-    clang.getDiagnostics())) { return false; }
+  std::shared_ptr<const CompilerInvocation> cached;
+  if (plan && job.inputArg < job.args.size()) {
+    std::lock_guard<std::mutex> lock(plan->m);
+    cached = plan->invocation;
+  }
+  if (cached && cached->getFrontendOpts().Inputs.size() == 1) {
+    // Same arguments except for input and output names.
+    auto invocation = std::make_shared<CompilerInvocation>(*cached);
+    FrontendOptions& frontendOpts = invocation->getFrontendOpts();
+    FrontendInputFile& in = frontendOpts.Inputs[0];
+    in = FrontendInputFile(job.args[job.inputArg], in.getKind(), in.isSystem());
+    for (size_t i = 0; i + 1 < job.args.size(); ++i) {
+      if (job.args[i] == "-o") { frontendOpts.OutputFile = job.args[i + 1]; }
+      else if (job.args[i] == "-main-file-name") { invocation->getCodeGenOpts().MainFileName = job.args[i + 1]; }
+    }
+    clang.setInvocation(invocation);
+    // Diagnostics are printed with the parsed options, as when parsing
+    // into the existing invocation.
+    clang.getDiagnostics().setClient(new TextDiagnosticPrinter(llvm::errs(), &clang.getDiagnosticOpts()));
+  } else {
+    if (!CompilerInvocation::CreateFromArgs(clang.getInvocation(), job.argv,
+      clang.getDiagnostics())) { return false; }
+    if (plan && job.inputArg < job.args.size()) {
+      std::lock_guard<std::mutex> lock(plan->m);
+      if (!plan->invocation) {
+        plan->invocation = std::make_shared<CompilerInvocation>(clang.getInvocation());
+      }
+    }
+  }
+  // -disable-free is filtered out of job arguments.
+  clang.getFrontendOpts().DisableFree = IsFastTeardown();
   if (!ParseLLVMOptions(clang.getFrontendOpts().LLVMArgs)) { return false; }
   return true;
 }
 
-bool AMDGPUCompiler::PrepareAssembler(AssemblerInvocation &Opts, const Command& job) {
+bool AMDGPUCompiler::PrepareAssembler(AssemblerInvocation &Opts, const PlannedJob& job) {
   ResetOptionsToDefault();
-  if (!CreateAssemblerInvocationFromArgs(Opts, llvm::makeArrayRef(GetJobArgsFitered(job)))) { return false; }
-  if (diags.hasErrorOccurred()) { return false; }
+  if (!CreateAssemblerInvocationFromArgs(Opts, job.argv)) { return false; }
+  if (Diags().hasErrorOccurred()) { return false; }
   if (!ParseLLVMOptions(Opts.LLVMArgs)) { return false; }
   return true;
 }
 
+bool AMDGPUCompiler::BuildJobPlan(const Compilation& C, const std::string& input, const std::string& output, JobPlan& plan) {
+  const ArgStringList& temps = C.getTempFiles();
+  std::string mainFileName = sys::path::filename(input).str();
+  bool cacheable = true;
+  for (const Command& J : C.getJobs()) {
+    JobPlan::Job job;
+    job.name = J.getCreator().getName();
+    ArgStringList args = GetJobArgsFitered(J);
+    for (size_t a = 0; a < args.size(); ++a) {
+      StringRef arg(args[a]);
+      int slot = -1;
+      if (a > 0 && StringRef(args[a - 1]) == "-main-file-name" && arg == mainFileName) {
+        slot = JobPlan::SLOT_MAIN_FILE_NAME;
+      } else if (arg == input) {
+        slot = JobPlan::SLOT_INPUT;
+      } else if (arg == output) {
+        slot = JobPlan::SLOT_OUTPUT;
+      } else {
+        for (size_t t = 0; t < temps.size(); ++t) {
+          if (arg == temps[t]) { slot = JobPlan::SLOT_TEMP + t; break; }
+        }
+      }
+      if (slot >= 0) {
+        job.slots.push_back(std::make_pair(a, unsigned(slot)));
+        job.args.push_back(std::string());
+        continue;
+      }
+      // Names embedded in other arguments cannot be patched.
+      if (arg.contains(input) || arg.contains(output)) { cacheable = false; }
+      for (const char* temp : temps) {
+        if (arg.contains(temp)) { cacheable = false; }
+      }
+      job.args.push_back(arg.str());
+    }
+    plan.jobs.push_back(std::move(job));
+  }
+  for (const char* temp : temps) {
+    plan.tempExts.push_back(sys::path::extension(temp).str());
+  }
+  return cacheable;
+}
+
+std::shared_ptr<JobPlan> AMDGPUCompiler::PlanJobs(ArrayRef<const char*> args, const std::string& input,
+                                                  const std::string& output, std::vector<PlannedJob>& jobs) {
+  bool useCache = !IsVar("AMD_OCL_DISABLE_JOB_CACHE", false);
+  std::string key;
+  std::shared_ptr<JobPlan> plan;
+  if (useCache) {
+    // Driver output depends on working directory and input file extension.
+    SmallString<256> cwd;
+    sys::fs::current_path(cwd);
+    key = cwd.str().str();
+    key += '\0';
+    key += sys::path::extension(input).str();
+    for (const char* arg : args) {
+      key += '\0';
+      if (input == arg) { key += "\1input"; }
+      else if (output == arg) { key += "\1output"; }
+      else { key += arg; }
+      // Plans with per-call temp paths, e.g. -I of embedded headers or
+      // -include of placeholder declarations, would never be reused. Paths
+      // may be in temp directories of other compilers, e.g. of the parent of
+      // worker compilers.
+      if (input != arg && output != arg && TempFiles::Instance().IsTempPath(arg)) {
+        useCache = false;
+        break;
+      }
+    }
+  }
+  if (useCache) {
+    plan = JobPlans::Instance().Find(key);
+    MetricsRegistry::Instance().Cache("job_plans", plan != nullptr);
+  }
+  if (!plan) {
+    std::unique_ptr<Driver> driver(new Driver("", STRING(AMDGCN_TRIPLE), Diags()));
+    InitDriver(driver);
+    std::unique_ptr<Compilation> C(driver->BuildCompilation(args));
+    if (!C || C->containsError()) { return nullptr; }
+    plan = std::make_shared<JobPlan>();
+    if (BuildJobPlan(*C, input, output, *plan) && useCache) {
+      JobPlans::Instance().Add(key, plan);
+    }
+    // Driver temp files are removed with the compilation, compiler temp
+    // files are used instead.
+  }
+  std::vector<std::string> temps;
+  for (const std::string& ext : plan->tempExts) {
+    std::string name = TempFiles::Instance().NewTempName(CompilerTempDir()->Name().c_str(), "d_", 0);
+    File* temp = NewTempFile(DT_INTERNAL, sys::path::filename(name).str() + ext, CompilerTempDir());
+    if (!temp) { return nullptr; }
+    temps.push_back(temp->Name());
+  }
+  std::string mainFileName = sys::path::filename(input).str();
+  jobs.clear();
+  for (const JobPlan::Job& J : plan->jobs) {
+    PlannedJob job;
+    job.name = J.name;
+    job.args = J.args;
+    for (const auto& slot : J.slots) {
+      std::string& arg = job.args[slot.first];
+      switch (slot.second) {
+        case JobPlan::SLOT_INPUT: arg = input; job.inputArg = slot.first; break;
+        case JobPlan::SLOT_OUTPUT: arg = output; break;
+        case JobPlan::SLOT_MAIN_FILE_NAME: arg = mainFileName; break;
+        default: arg = temps[slot.second - JobPlan::SLOT_TEMP]; break;
+      }
+    }
+    job.SetArgs();
+    jobs.push_back(std::move(job));
+  }
+  return plan;
+}
+
 bool AMDGPUCompiler::IsVar(const std::string& sEnvVar, bool bVar) {
   const char* env = getenv(sEnvVar.c_str());
   if (env) {
@@ -827,6 +2009,98 @@ LogLevel AMDGPUCompiler::GetLogLevel() {
   return logLevel;
 }
 
+CompilePriority AMDGPUCompiler::GetPriority() {
+  if (const char* env = getenv("AMD_OCL_PRIORITY")) {
+    unsigned p = unsigned(strtoul(env, 0, 10));
+    return p > CP_LAST ? CP_LAST : CompilePriority(p);
+  }
+  return priority;
+}
+
+unsigned AMDGPUCompiler::GetParallelJobs() {
+  if (const char* env = getenv("AMD_OCL_PARALLEL_JOBS")) { return unsigned(strtoul(env, 0, 10)); }
+  return parallelJobs;
+}
+
+unsigned AMDGPUCompiler::GetTimeout() {
+  if (const char* env = getenv("AMD_OCL_TIMEOUT")) { return unsigned(strtoul(env, 0, 10)); }
+  return timeout;
+}
+
+bool AMDGPUCompiler::CheckDeadline() {
+  if (timedOut) { return false; }
+  if (!hasDeadline || std::chrono::steady_clock::now() < deadline) { return true; }
+  timedOut = true;
+  OS << "ERROR: Compilation timed out after " << GetTimeout() << " ms.\n";
+  return false;
+}
+
+int AMDGPUCompiler::WaitChild(const sys::ProcessInfo& PI) {
+  if (!hasDeadline) { return sys::Wait(PI, 0, true).ReturnCode; }
+  // Child is polled, as waiting with timeout uses process-wide alarm and
+  // SIGALRM handler on Unix, shared by concurrent calls and the host.
+  std::chrono::milliseconds delay(1);
+  while (std::chrono::steady_clock::now() < deadline) {
+    sys::ProcessInfo res = sys::Wait(PI, 0, false);
+    if (res.Pid != 0) { return res.ReturnCode; }
+    std::this_thread::sleep_for(delay);
+    if (delay < std::chrono::milliseconds(50)) { delay *= 2; }
+  }
+#ifdef _WIN32
+  ::TerminateProcess(PI.Process, 1);
+#else
+  ::kill(PI.Pid, SIGKILL);
+#endif
+  sys::Wait(PI, 0, true);
+  CheckDeadline();
+  return -2;
+}
+
+#ifdef __linux__
+// Kills child processes of this process running one of jobs. Driver does
+// not expose ids of its children, so these are found by parent and command
+// line. Jobs passing arguments in response files are not matched.
+static void KillJobProcesses(const JobList& jobs) {
+  std::error_code EC;
+  std::string self = std::to_string(::getpid());
+  for (sys::fs::directory_iterator I("/proc", EC), E; !EC && I != E; I.increment(EC)) {
+    StringRef name = sys::path::filename(I->path());
+    unsigned pid;
+    if (name.getAsInteger(10, pid)) { continue; }
+    std::ifstream statFile(I->path() + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(statFile)), std::istreambuf_iterator<char>());
+    // Parent follows process name in parentheses and state.
+    size_t pos = stat.rfind(')');
+    if (pos == std::string::npos) { continue; }
+    SmallVector<StringRef, 4> fields;
+    StringRef(stat).substr(pos + 1).split(fields, ' ', 3, false);
+    if (fields.size() < 2 || fields[1] != self) { continue; }
+    std::ifstream cmdlineFile(I->path() + "/cmdline");
+    std::string cmdline((std::istreambuf_iterator<char>(cmdlineFile)), std::istreambuf_iterator<char>());
+    SmallVector<StringRef, 32> argv;
+    StringRef(cmdline).split(argv, '\0');
+    // Command line ends with null.
+    if (!argv.empty() && argv.back().empty()) { argv.pop_back(); }
+    for (const Command& job : jobs) {
+      const llvm::opt::ArgStringList& jobArgs = job.getArguments();
+      if (argv.size() != jobArgs.size() + 1) { continue; }
+      if (std::equal(jobArgs.begin(), jobArgs.end(), argv.begin() + 1,
+                     [](const char* a, StringRef b) { return b == a; })) {
+        ::kill(pid_t(pid), SIGKILL);
+        break;
+      }
+    }
+  }
+}
+#endif // __linux__
+
+void AMDGPUCompiler::YieldCallback(LLVMContext* context, void* handle) {
+  AMDGPUCompiler* compiler = static_cast<AMDGPUCompiler*>(handle);
+  if (compiler->CheckDeadline()) { return; }
+  // Jobs of calls with deadline run under crash recovery.
+  if (CrashRecoveryContext* crc = CrashRecoveryContext::GetCurrent()) { crc->HandleCrash(); }
+}
+
 const std::string& AMDGPUCompiler::Output() {
   output = {};
   if (GetLogLevel() > LL_QUIET) { OS.flush(); }
@@ -848,13 +2122,24 @@ bool AMDGPUCompiler::Return(bool retValue) {
 }
 
 void AMDGPUCompiler::PrintJobs(const JobList &jobs) {
+  if (GetLogLevel() < LL_VERBOSE || jobs.empty()) { return; }
+  std::vector<PlannedJob> planned;
+  for (auto const & J : jobs) {
+    PlannedJob job;
+    job.name = J.getCreator().getName();
+    for (auto A : GetJobArgsFitered(J)) { job.args.push_back(A); }
+    planned.push_back(std::move(job));
+  }
+  PrintJobs(planned);
+}
+
+void AMDGPUCompiler::PrintJobs(ArrayRef<PlannedJob> jobs) {
   if (GetLogLevel() < LL_VERBOSE || jobs.empty()) { return; }
   OS << "\n[AMD OCL] " << jobs.size() << " job" << (jobs.size() == 1 ? "" : "s") << ":\n";
   int i = 1;
   for (auto const & J : jobs) {
-    std::string sJobName(J.getCreator().getName());
-    OS << (i > 1 ? "\n" : "") << "  JOB [" << i << "] " << sJobName << "\n";
-    for (auto A : GetJobArgsFitered(J)) {
+    OS << (i > 1 ? "\n" : "") << "  JOB [" << i << "] " << J.name << "\n";
+    for (auto const & A : J.args) {
       OS << "      " << A << "\n";
     }
     ++i;
@@ -881,34 +2166,64 @@ void AMDGPUCompiler::PrintOptions(ArrayRef<const char*> args, const std::string&
 
 AMDGPUCompiler::AMDGPUCompiler(const std::string& llvmBin_)
   : OS(output),
-    diagOpts(new DiagnosticOptions()),
-    diagClient(new TextDiagnosticPrinter(OS, &*diagOpts)),
-    diags(diagID, &*diagOpts, &*diagClient),
     llvmBin(llvmBin_),
     llvmLinkExe(llvmBin + "/llvm-link"),
     compilerTempDir(0),
     inprocess(true),
     logLevel(LL_ERRORS),
     printlog(false),
-    keeptmp(false) {
-  LLVMInitializeAMDGPUTarget();
-  LLVMInitializeAMDGPUTargetInfo();
-  LLVMInitializeAMDGPUTargetMC();
-  LLVMInitializeAMDGPUDisassembler();
-  if (IsInProcess()) {
-    LLVMInitializeAMDGPUAsmParser();
-    LLVMInitializeAMDGPUAsmPrinter();
-  }
+    keeptmp(false),
+    compactbc(false),
+    bcsummary(false),
+    fastteardown(false),
+    crashrecovery(false),
+    timeout(0),
+    hasDeadline(false),
+    timedOut(false),
+    contextpooling(false),
+    residentlibs(false),
+    lto(false),
+    parallelJobs(1),
+    callDepth(0),
+    callScope(nullptr),
+    priority(CP_NORMAL),
+    children(0) {
+  InitializeTarget(IsInProcess());
+}
+
+AMDGPUCompiler* AMDGPUCompiler::NewWorkerCompiler() {
+  AMDGPUCompiler* worker = new AMDGPUCompiler(llvmBin);
+  worker->inprocess = inprocess;
+  worker->keeptmp = keeptmp;
+  worker->fastteardown = fastteardown;
+  worker->crashrecovery = crashrecovery;
+  worker->timeout = timeout;
+  worker->priority = priority;
+  worker->hasDeadline = hasDeadline;
+  worker->deadline = deadline;
+  worker->contextpooling = contextpooling;
+  worker->residentlibs = residentlibs;
+  worker->lto = lto;
+  worker->parallelJobs = parallelJobs;
+  worker->logLevel = logLevel;
+  // Log of worker is appended to the log of this compiler.
+  worker->printlog = false;
+  // Worker runs within the call of this compiler, which is already admitted
+  // by CompileScheduler and measured.
+  worker->callDepth = 1;
+  return worker;
 }
 
 AMDGPUCompiler::~AMDGPUCompiler() {
+  if (warmUpCancel) { *warmUpCancel = true; }
+  if (warmUpThread.joinable()) { warmUpThread.join(); }
   for (size_t i = datas.size(); i > 0; --i) {
     delete datas[i-1];
   }
 }
 
 bool AMDGPUCompiler::InvokeDriver(ArrayRef<const char*> args) {
-  std::unique_ptr<Driver> driver(new Driver(llvmBin + "/clang", STRING(AMDGCN_TRIPLE), diags));
+  std::unique_ptr<Driver> driver(new Driver(llvmBin + "/clang", STRING(AMDGCN_TRIPLE), Diags()));
   InitDriver(driver);
   std::unique_ptr<Compilation> C(driver->BuildCompilation(args));
   PrintJobs(C->getJobs());
@@ -920,7 +2235,38 @@ bool AMDGPUCompiler::InvokeDriver(ArrayRef<const char*> args) {
   int Res = 0;
   SmallVector<std::pair<int, const Command *>, 4> failingCommands;
   if (C.get()) {
+    children += C->getJobs().size();
+    MetricsRegistry::Instance().Add(&CompilerMetrics::childProcesses, C->getJobs().size());
+#ifdef __linux__
+    // Driver waits for jobs without limit, so jobs still running at deadline
+    // are killed by watchdog.
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread watchdog;
+    if (hasDeadline) {
+      watchdog = std::thread([&]() {
+        std::unique_lock<std::mutex> lock(m);
+        if (cv.wait_until(lock, deadline, [&]() { return done; })) { return; }
+        // Driver may be starting next job meanwhile.
+        do {
+          KillJobProcesses(C->getJobs());
+        } while (!cv.wait_for(lock, std::chrono::milliseconds(10), [&]() { return done; }));
+      });
+    }
+#endif // __linux__
     Res = driver->ExecuteCompilation(*C, failingCommands);
+#ifdef __linux__
+    if (watchdog.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(m);
+        done = true;
+      }
+      cv.notify_one();
+      watchdog.join();
+    }
+#endif // __linux__
+    if (Res != 0) { CheckDeadline(); }
   }
   for (const auto &P : failingCommands) {
     int CommandRes = P.first;
@@ -930,7 +2276,8 @@ bool AMDGPUCompiler::InvokeDriver(ArrayRef<const char*> args) {
     // If result status is 70, then the driver command reported a fatal error.
     // On Windows, abort will return an exit code of 3.  In these cases,
     // generate additional diagnostic information if possible.
-    bool DiagnoseCrash = CommandRes < 0 || CommandRes == 70;
+    // Job killed on timeout is not a crash.
+    bool DiagnoseCrash = !timedOut && (CommandRes < 0 || CommandRes == 70);
 #ifdef LLVM_ON_WIN32
     DiagnoseCrash |= CommandRes == 3;
 #endif
@@ -956,6 +2303,7 @@ bool AMDGPUCompiler::InvokeDriver(ArrayRef<const char*> args) {
 
 bool AMDGPUCompiler::InvokeTool(ArrayRef<const char*> args, const std::string& sToolName) {
   PrintOptions(args, sToolName, false);
+  if (!CheckDeadline()) { return false; }
   SmallVector<const char*, 128> args1;
   args1.push_back(sToolName.c_str());
   for (const char *arg : args) { args1.push_back(arg); }
@@ -966,12 +2314,22 @@ bool AMDGPUCompiler::InvokeTool(ArrayRef<const char*> args, const std::string& s
       {None, StringRef(out->Name()), StringRef(err->Name())};
   Optional<ArrayRef<StringRef>> Env;
   auto Args = llvm::toStringRefArray(args1.data());
-  int res = llvm::sys::ExecuteAndWait(sToolName, Args, Env, Redirects);
+  ++children;
+  MetricsRegistry::Instance().Add(&CompilerMetrics::childProcesses);
+  std::string ErrMsg;
+  sys::ProcessInfo PI = sys::ExecuteNoWait(sToolName, Args, Env, Redirects, 0, &ErrMsg);
+  int res = -1;
+  if (PI.Pid == sys::ProcessInfo::InvalidPid) {
+    if (GetLogLevel() >= LL_ERRORS) { OS << "ERROR: " << ErrMsg << "\n"; }
+  } else {
+    res = WaitChild(PI);
+  }
   std::string outStr, errStr;
   out->ReadToString(outStr);
   err->ReadToString(errStr);
   if (GetLogLevel() >= LL_LLVM_ONLY && !outStr.empty()) { OS << outStr; }
   if (GetLogLevel() >= LL_ERRORS && !errStr.empty()) { OS << errStr; }
+  if (res != 0) { CheckDeadline(); }
   return res == 0;
 }
 
@@ -994,19 +2352,36 @@ FileReference* AMDGPUCompiler::NewFileReference(DataType type, const std::string
 }
 
 File* AMDGPUCompiler::NewTempFile(DataType type, const std::string& name, File* parent) {
+  // Captured output of tools is never passed by name to other tools,
+  // so it can be kept in memory.
+  if (type == DT_INTERNAL && !parent && name.empty()) {
+    int fd = TempFiles::Instance().NewMemFile();
+    if (fd >= 0) {
+      MetricsRegistry::Instance().Add(&CompilerMetrics::tempFiles);
+      return AddData(new MemTempFile(this, type, fd));
+    }
+  }
+  // Names in directories given by the caller do not need the pid, as these
+  // are private to this process.
+  bool pid = !parent;
   if (!parent) { parent = CompilerTempDir(); }
   const char* dir = parent->Name().c_str();
   const char* ext = DataTypeExt(type);
-  bool pid = !parent;
   std::string fname = name.empty() ?
                         TempFiles::Instance().NewTempName(dir, "t_", ext, pid) :
                         JoinFileName(parent->Name(), name);
-  if (FileExists(fname)) { return 0; }
+  // Create the file, failing if it already exists.
+  int fd;
+  if (sys::fs::openFileForWrite(fname, fd, sys::fs::CD_CreateNew)) { return 0; }
+  sys::Process::SafelyCloseFileDescriptor(fd);
+  MetricsRegistry::Instance().Add(&CompilerMetrics::tempFiles);
   return AddData(new TempFile(this, type, fname));
 }
 
 File* AMDGPUCompiler::NewTempDir(File* parent) {
-  const char* dir = parent ? parent->Name().c_str() : 0;
+  std::string shardDir;
+  if (!parent) { shardDir = TempFiles::Instance().ShardDir(); }
+  const char* dir = parent ? parent->Name().c_str() : shardDir.c_str();
   bool pid = !parent;
   std::string name = TempFiles::Instance().NewTempName(dir, "AMD_", 0, pid);
 #ifdef _WIN32
@@ -1014,6 +2389,7 @@ File* AMDGPUCompiler::NewTempDir(File* parent) {
 #else // _WIN32
   mkdir(name.c_str(), 0700);
 #endif // _WIN32
+  MetricsRegistry::Instance().Add(&CompilerMetrics::tempFiles);
   return AddData(new TempDir(this, name));
 }
 
@@ -1027,6 +2403,9 @@ Buffer* AMDGPUCompiler::NewBuffer(DataType type) {
 
 bool AMDGPUCompiler::CompileToLLVMBitcode(Data* input, Data* output, const std::vector<std::string>& options) {
   PrintPhase("CompileToLLVMBitcode", IsInProcess());
+  PhaseTimer phase("CompileToLLVMBitcode");
+  if (callScope) { callScope->Yield(); }
+  if (!CheckDeadline()) { return Return(false); }
   std::vector<const char*> args;
   StartWithCommonArgs(args);
   if (input->Type() == DT_ASSEMBLY) {
@@ -1053,46 +2432,172 @@ bool AMDGPUCompiler::CompileToLLVMBitcode(Data* input, Data* output, const std::
   }
   PrintOptions(args, clangDriverName, IsInProcess());
   if (IsInProcess()) {
-    std::unique_ptr<Driver> driver(new Driver("", STRING(AMDGCN_TRIPLE), diags));
-    InitDriver(driver);
-    std::unique_ptr<Compilation> C(driver->BuildCompilation(args));
-    const JobList &Jobs = C->getJobs();
+    std::vector<PlannedJob> Jobs;
+    std::shared_ptr<JobPlan> plan = PlanJobs(args, inputFile->Name(), bcFile->Name(), Jobs);
+    if (!plan || Jobs.empty()) { return Return(false); }
     PrintJobs(Jobs);
-    CompilerInstance Clang;
-    if (!PrepareCompiler(Clang, *Jobs.begin())) { return Return(false); }
-    if (!ExecuteCompiler(Clang, Backend_EmitBC)) { return Return(false); }
+    std::unique_lock<std::mutex> jobLock = LLVMOptions::Instance().LockJob();
+    std::unique_ptr<CompilerInstance> Clang(new CompilerInstance());
+    if (!PrepareCompiler(*Clang, Jobs[0], plan.get())) { return Return(false); }
+    bool crashed;
+    bool res = RunJobSafely(Jobs[0].name, [&]() { return ExecuteCompiler(*Clang, Backend_EmitBC); }, crashed);
+    // State of crashed compiler instance is unknown, so it is not freed.
+    if (IsFastTeardown() || crashed) { BuryPointer(std::move(Clang)); }
+    if (!res) { return Return(false); }
   } else {
     if (!InvokeDriver(args)) { return Return(false); }
   }
   return Return(output->ReadOutputFile(bcFile));
 }
 
+// Optimization level of clang options, OpenCL default is -O2.
+static unsigned OptLevel(const std::vector<std::string>& options) {
+  unsigned level = 2;
+  for (const std::string& o : options) {
+    if (o == "-cl-opt-disable" || o == "-O0") { level = 0; }
+    else if (o == "-O1") { level = 1; }
+    else if (o == "-O" || o == "-O2" || o == "-Os" || o == "-Oz") { level = 2; }
+    else if (o == "-O3" || o == "-Ofast") { level = 3; }
+  }
+  return level;
+}
+
+// Optimize linked module across translation units. Functions other than
+// kernels are internalized, so that they are inlined into kernels and
+// removed when no longer used. Passes are set up for the target of the
+// module, as clang does for the frontend.
+static void OptimizeAcrossUnits(Module& M, unsigned optLevel) {
+  Triple triple(M.getTargetTriple());
+  std::string error;
+  std::unique_ptr<TargetMachine> TM;
+  if (const Target* T = TargetRegistry::lookupTarget(triple.getTriple(), error)) {
+    TM.reset(T->createTargetMachine(triple.getTriple(), "", "", TargetOptions(), None, None,
+                                    CodeGenOpt::Level(optLevel)));
+  }
+  legacy::PassManager PM;
+  PM.add(new TargetLibraryInfoWrapperPass(triple));
+  if (TM) { PM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis())); }
+  PM.add(createInternalizePass([](const GlobalValue& GV) {
+    const Function* F = dyn_cast<Function>(&GV);
+    if (!F) { return true; }
+    CallingConv::ID cc = F->getCallingConv();
+    return cc == CallingConv::AMDGPU_KERNEL || cc == CallingConv::SPIR_KERNEL;
+  }));
+  PM.add(createGlobalDCEPass());
+  PassManagerBuilder builder;
+  builder.OptLevel = optLevel;
+  builder.Inliner = createFunctionInliningPass(optLevel, 0, false);
+  builder.LibraryInfo = new TargetLibraryInfoImpl(triple);
+  if (TM) { TM->adjustPassManager(builder); }
+  builder.populateModulePassManager(PM);
+  PM.run(M);
+}
+
 const std::vector<std::string> emptyOptions;
 
 bool AMDGPUCompiler::CompileToLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) {
+  CallScope scope(this, "CompileToLLVMBitcode", inputs, output);
+  return scope.Result(CompileToLLVMBitcode(inputs, output, options, true));
+}
+
+bool AMDGPUCompiler::CompileToLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool finalOutput) {
   if (inputs.size() == 1) {
-    return CompileToLLVMBitcode(inputs[0], output, options);
+    if (!CompileToLLVMBitcode(inputs[0], output, options)) { return false; }
+    return !finalOutput || Return(CompactBitcode(output));
   } else {
     std::vector<Data*> bcFiles;
     std::vector<std::string> xoptions;
     File* includeDir = 0;
+    // In-process frontends read embedded headers from memory, other
+    // headers are written to include directory.
+    std::vector<Data*> memHeaders;
     for (Data* input : inputs) {
-      if (input->Type() == DT_CL_HEADER) {
-        if (!includeDir) {
-          includeDir = NewTempDir(CompilerTempDir());
-          xoptions.push_back("-I" + includeDir->Name());
-        }
-        ToInputFile(input, includeDir);
+      const char* ptr;
+      size_t size;
+      if (input->Type() != DT_CL_HEADER) { continue; }
+      if (IsInProcess() && !input->Id().empty() && input->MemoryRef(ptr, size)) {
+        memHeaders.push_back(input);
+        continue;
       }
+      if (!includeDir) {
+        includeDir = NewTempDir(CompilerTempDir());
+        xoptions.push_back("-I" + includeDir->Name());
+      }
+      ToInputFile(input, includeDir);
+    }
+    IntrusiveRefCntPtr<vfs::FileSystem> headers;
+    if (!memHeaders.empty()) {
+      std::string headersDir;
+      headers = HeaderSets::Instance().Find(memHeaders, headersDir);
+      xoptions.push_back("-I" + headersDir);
     }
     for (const std::string& o : options) { xoptions.push_back(o); }
+    std::vector<FileReference*> sources;
     for (Data* input : inputs) {
       if (input->Type() == DT_CL_HEADER) { continue; }
-      File* bcFile = NewTempFile(DT_LLVM_BC);
-      if (!CompileToLLVMBitcode(input, bcFile, xoptions)) { return false; }
-      bcFiles.push_back(bcFile);
+      FileReference* source = ToInputFile(input, CompilerTempDir());
+      if (!source) { return Return(false); }
+      sources.push_back(source);
+      bcFiles.push_back(NewTempFile(DT_LLVM_BC));
+    }
+    // With parallel jobs, frontends run in parallel on worker compilers,
+    // while this thread links their modules in input order as soon as they
+    // are ready. Otherwise they run one after another before linking.
+    // Workers own all their Data, so they do not touch this compiler.
+    // In-process frontends hold the job lock, as they parse global LLVM
+    // options.
+    size_t n = sources.size();
+    std::vector<std::unique_ptr<AMDGPUCompiler>> workers;
+    for (size_t i = 0; i < n; ++i) {
+      workers.emplace_back(NewWorkerCompiler());
+      workers.back()->headerFS = headers;
+    }
+    std::vector<char> done(n, 0);
+    std::vector<char> results(n, 0);
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic_size_t next(0);
+    std::atomic_bool failed(false);
+    auto frontend = [&]() {
+      for (size_t i = next++; i < n; i = next++) {
+        AMDGPUCompiler* worker = workers[i].get();
+        bool res = false;
+        if (!failed) {
+          Data* winput = worker->NewFileReference(sources[i]->Type(), sources[i]->Name());
+          File* woutput = worker->NewFile(DT_LLVM_BC, static_cast<File*>(bcFiles[i])->Name());
+          res = worker->CompileToLLVMBitcode(winput, woutput, xoptions);
+        }
+        // Frontends not started yet are skipped after failed one.
+        if (!res) { failed = true; }
+        std::lock_guard<std::mutex> lock(m);
+        results[i] = res;
+        done[i] = 1;
+        cv.notify_all();
+      }
+    };
+    size_t nthreads = GetParallelJobs();
+    if (nthreads == 0) { nthreads = std::max(1u, std::thread::hardware_concurrency()); }
+    if (nthreads > n) { nthreads = n; }
+    std::vector<std::thread> threads;
+    if (nthreads == 1) {
+      frontend();
+    } else {
+      for (size_t t = 0; t < nthreads; ++t) { threads.emplace_back(frontend); }
     }
-    return LinkLLVMBitcode(bcFiles, output, emptyOptions);
+    std::function<bool(size_t)> ready = [&](size_t i) {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [&]() { return done[i] != 0; });
+      return results[i] != 0;
+    };
+    // Intermediate output is compiled into executable, so only kernels
+    // need to stay visible.
+    unsigned ltoLevel = !finalOutput && IsLinkTimeOptimization() ? OptLevel(options) : 0;
+    bool res = LinkLLVMBitcode(bcFiles, output, emptyOptions, finalOutput, ready, ltoLevel);
+    // Frontends not started yet are skipped after failed link.
+    failed = true;
+    for (std::thread& t : threads) { t.join(); }
+    for (auto& worker : workers) { OS << worker->Output(); }
+    return Return(res);
   }
 }
 
@@ -1101,66 +2606,197 @@ bool AMDGPUCompiler::EmitLinkerError(LLVMContext &context, const Twine &message)
   return false;
 }
 
+std::unique_ptr<Module> AMDGPUCompiler::LinkModules(ArrayRef<const char*> files, LLVMContext& context, PooledContext* residents,
+                                                    const std::function<bool(size_t)>& ready) {
+  auto Composite = std::make_unique<llvm::Module>("composite", context);
+  Linker L(*Composite);
+  unsigned ApplicableFlags = Linker::Flags::None;
+  for (size_t i = 0; i < files.size(); ++i) {
+    const char* arg = files[i];
+    if (ready && !ready(i)) { return nullptr; }
+    if (!CheckDeadline()) { return nullptr; }
+    SMDiagnostic error;
+    std::unique_ptr<Module> m;
+    if (residents) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> mb = MemoryBuffer::getFile(arg);
+      if (mb) {
+        if (Module* resident = residents->Resident((*mb)->getBuffer(), arg, error)) {
+          // Linker consumes module, so resident one is cloned. Resident may
+          // have been loaded from another file with the same contents.
+          m = CloneModule(*resident);
+          m->setModuleIdentifier(arg);
+        } else {
+          m = getLazyIRModule(std::move(*mb), error, context);
+        }
+      }
+    } else {
+      m = getLazyIRFileModule(arg, error, context);
+    }
+    if (!m.get()) {
+      EmitLinkerError(context, "The module '" + Twine(arg) + "' loading failed.");
+      return nullptr;
+    }
+    if (verifyModule(*m, &errs())) {
+      EmitLinkerError(context, "The loaded module '" + Twine(arg) + "' to link is broken.");
+      return nullptr;
+    }
+    if (GetLogLevel() >= LL_LLVM_ONLY) {
+      OS << "[AMD OCL] Linking in '" << arg << "'" << "\n";
+    }
+    if (L.linkInModule(std::move(m), ApplicableFlags)) {
+      EmitLinkerError(context, "The module '" + Twine(arg) + "' is not linked.");
+      return nullptr;
+    }
+  }
+  return Composite;
+}
+
+// Strip from module what is not needed to generate code.
+static void CompactModule(Module& M) {
+  StripDebugInfo(M);
+  for (Function& F : M) {
+    CallingConv::ID cc = F.getCallingConv();
+    // Names of kernel arguments are reported in code object metadata.
+    if (cc != CallingConv::AMDGPU_KERNEL && cc != CallingConv::SPIR_KERNEL) {
+      for (Argument& A : F.args()) { A.setName(""); }
+    }
+    for (BasicBlock& BB : F) {
+      BB.setName("");
+      for (Instruction& I : BB) { I.setName(""); }
+    }
+  }
+  for (auto it = M.begin(); it != M.end();) {
+    Function& F = *it++;
+    if (F.isDeclaration() && F.use_empty()) { F.eraseFromParent(); }
+  }
+  for (auto it = M.global_begin(); it != M.global_end();) {
+    GlobalVariable& GV = *it++;
+    if (GV.isDeclaration() && GV.use_empty()) { GV.eraseFromParent(); }
+  }
+  if (NamedMDNode* ident = M.getNamedMetadata("llvm.ident")) {
+    M.eraseNamedMetadata(ident);
+  }
+}
+
+bool AMDGPUCompiler::WriteBitcode(Module& M, File* file, bool finalOutput) {
+  std::error_code ec;
+  llvm::ToolOutputFile out(file->Name(), ec, sys::fs::F_None);
+  if (ec) { return EmitLinkerError(M.getContext(), "The file '" + file->Name() + "' cannot be written."); }
+  if (finalOutput && file->Type() != DT_LLVM_LL && IsCompactBitcode()) { CompactModule(M); }
+  if (finalOutput && file->Type() != DT_LLVM_LL && IsBitcodeSummary()) {
+    ModuleSummaryIndex index = buildModuleSummaryIndex(M, nullptr, nullptr);
+    WriteBitcodeToFile(M, out.os(), false, &index);
+  } else {
+    WriteBitcodeToFile(M, out.os());
+  }
+  out.keep();
+  return true;
+}
+
+bool AMDGPUCompiler::CompactBitcode(Data* output) {
+  if (output->Type() != DT_LLVM_BC || (!IsCompactBitcode() && !IsBitcodeSummary())) { return true; }
+  std::unique_ptr<MemoryBuffer> mb;
+  StringRef contents;
+  if (!ReadData(output, mb, contents)) { return false; }
+  LLVMContext context;
+  context.setDiagnosticHandler(
+      std::make_unique<AMDGPUCompilerDiagnosticHandler>(this), true);
+  SMDiagnostic err;
+  std::unique_ptr<Module> M = parseIR(MemoryBufferRef(contents, "output"), err, context);
+  mb.reset();
+  if (!M) { return EmitLinkerError(context, "The output module cannot be loaded."); }
+  File* outputFile = ToOutputFile(output, CompilerTempDir());
+  if (!outputFile || !WriteBitcode(*M, outputFile, true)) { return false; }
+  return output->ReadOutputFile(outputFile);
+}
+
+bool AMDGPUCompiler::OptimizeLinkedBitcode(File* file, unsigned optLevel) {
+  LLVMContext context;
+  context.setDiagnosticHandler(
+      std::make_unique<AMDGPUCompilerDiagnosticHandler>(this), true);
+  SMDiagnostic err;
+  std::unique_ptr<Module> M = parseIRFile(file->Name(), err, context);
+  if (!M) { return EmitLinkerError(context, "The linked module cannot be loaded."); }
+  OptimizeAcrossUnits(*M, optLevel);
+  return WriteBitcode(*M, file);
+}
+
+bool AMDGPUCompiler::WriteModule(Module& M, Data* output, const std::vector<std::string>& options) {
+  if (output->Type() == DT_EXECUTABLE) {
+    File* bcFile = NewTempFile(DT_LLVM_BC);
+    if (!bcFile || !WriteBitcode(M, bcFile)) { return false; }
+    return CompileAndLinkExecutable(bcFile, output, options);
+  }
+  File* outputFile = ToOutputFile(output, CompilerTempDir());
+  if (!outputFile || !WriteBitcode(M, outputFile, true)) { return false; }
+  return output->ReadOutputFile(outputFile);
+}
+
 bool AMDGPUCompiler::LinkLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) {
+  CallScope scope(this, "LinkLLVMBitcode", inputs, output);
+  return scope.Result(LinkLLVMBitcode(inputs, output, options, true));
+}
+
+bool AMDGPUCompiler::LinkLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool finalOutput,
+                                     const std::function<bool(size_t)>& ready, unsigned ltoLevel) {
   PrintPhase("LinkLLVMBitcode", IsInProcess());
+  PhaseTimer phase("LinkLLVMBitcode");
+  if (callScope) { callScope->Yield(); }
+  if (!CheckDeadline()) { return Return(false); }
   std::vector<const char*> args;
   for (Data* input : inputs) {
     FileReference* inputFile = ToInputFile(input, CompilerTempDir());
     args.push_back(inputFile->Name().c_str());
   }
   File* outputFile = ToOutputFile(output, CompilerTempDir());
-  if (!options.empty()) {
-    std::vector<const char*> argv;
-    for (auto option : options) {
-      if (IsInProcess()) {
-        argv.push_back("");
-        argv.push_back(option.c_str());
-        if (!cl::ParseCommandLineOptions(argv.size(), &argv[0], "llvm linker")) {
-          return Return(false);
-        }
-        argv.clear();
-      } else {
-        args.push_back(option.c_str());
-      }
-    }
-  }
   if (!IsInProcess()) {
+    for (const std::string& option : options) {
+      args.push_back(option.c_str());
+    }
     args.push_back("-o");
     args.push_back(outputFile->Name().c_str());
   }
   if (IsInProcess()) {
     PrintOptions(args, "llvm linker", IsInProcess());
-    LLVMContext context;
+    PooledContext pooled(IsContextPooling() || IsResidentLibraries());
+    LLVMContext& context = pooled.Context();
     context.setDiagnosticHandler(
         std::make_unique<AMDGPUCompilerDiagnosticHandler>(this), true);
-    auto Composite = std::make_unique<llvm::Module>("composite", context);
-    Linker L(*Composite);
-    unsigned ApplicableFlags = Linker::Flags::None;
-    for (auto arg : args) {
-      SMDiagnostic error;
-      auto m = getLazyIRFileModule(arg, error, context);
-      if (!m.get()) {
-        return Return(EmitLinkerError(context, "The module '" + Twine(arg) + "' loading failed."));
-      }
-      if (verifyModule(*m, &errs())) {
-        return Return(EmitLinkerError(context, "The loaded module '" + Twine(arg) + "' to link is broken."));
-      }
-      if (GetLogLevel() >= LL_LLVM_ONLY) {
-        OS << "[AMD OCL] Linking in '" << arg << "'" << "\n";
-      }
-      if (L.linkInModule(std::move(m), ApplicableFlags)) {
-        return Return(EmitLinkerError(context, "The module '" + Twine(arg) + "' is not linked."));
+    std::unique_ptr<Module> Composite;
+    std::unique_lock<std::mutex> jobLock;
+    bool crashed;
+    // Linking runs on this thread to keep using its pooled context.
+    bool res = RunJobSafely("llvm linker", [&]() {
+      Composite = LinkModules(args, context, IsResidentLibraries() && pooled.IsPooled() ? &pooled : nullptr, ready);
+      if (!Composite) { return false; }
+      // IR linking does not depend on LLVM options, so modules are linked
+      // without the job lock while frontends waited for by ready hold it.
+      jobLock = LLVMOptions::Instance().LockJob();
+      if (!LLVMOptions::Instance().Parse(options, "llvm linker")) { return false; }
+      if (verifyModule(*Composite, &errs())) {
+        return EmitLinkerError(context, "The linked module '" + outputFile->Name() + "' is broken.");
       }
+      if (ltoLevel) { OptimizeAcrossUnits(*Composite, ltoLevel); }
+      return WriteBitcode(*Composite, outputFile, finalOutput);
+    }, crashed, false);
+    if (crashed) {
+      Composite.release();
+      pooled.Discard();
     }
-    if (verifyModule(*Composite, &errs())) {
-      return Return(EmitLinkerError(context, "The linked module '" + outputFile->Name() + "' is broken."));
+    if (!res) { return Return(false); }
+    // Pooled context is reused by next links of this thread, so modules
+    // in it are freed instead of accumulating there.
+    if (IsFastTeardown() && !pooled.IsPooled()) {
+      BuryPointer(std::move(Composite));
+      BuryPointer(std::move(pooled.Own()));
     }
-    std::error_code ec;
-    llvm::ToolOutputFile out(outputFile->Name(), ec, sys::fs::F_None);
-    WriteBitcodeToFile(*Composite.get(), out.os());
-    out.keep();
   } else {
+    for (size_t i = 0; ready && i < inputs.size(); ++i) {
+      if (!ready(i)) { return Return(false); }
+    }
     if (!InvokeTool(args, llvmLinkExe)) { return Return(false); }
+    if (ltoLevel && !OptimizeLinkedBitcode(outputFile, ltoLevel)) { return Return(false); }
+    if (finalOutput && !CompactBitcode(outputFile)) { return Return(false); }
   }
   return Return(output->ReadOutputFile(outputFile));
 }
@@ -1208,10 +2844,26 @@ void AMDGPUCompiler::TransformOptionsForAssembler(const std::vector<std::string>
 
 bool AMDGPUCompiler::CompileAndLinkExecutable(Data* input, Data* output, const std::vector<std::string>& options) {
   PrintPhase("CompileAndLinkExecutable", IsInProcess());
+  PhaseTimer phase("CompileAndLinkExecutable");
+  if (callScope) { callScope->Yield(); }
+  if (!CheckDeadline()) { return Return(false); }
   std::vector<const char*> args;
   StartWithCommonArgs(args);
-  FileReference* inputFile = ToInputFile(input, CompilerTempDir());
-  args.push_back(inputFile->Name().c_str());
+  // In-process assembler reads in-memory sources directly, the input file
+  // name is then only used by the driver to plan the jobs.
+  const char* inputPtr = 0;
+  size_t inputSize = 0;
+  bool inputInMemory = IsInProcess() && input->Type() == DT_ASSEMBLY &&
+                       input->MemoryRef(inputPtr, inputSize);
+  std::string inputName;
+  if (inputInMemory) {
+    inputName = TempFiles::Instance().NewTempName(CompilerTempDir()->Name().c_str(), "t_", DataTypeExt(DT_ASSEMBLY));
+  } else {
+    FileReference* inputFile = ToInputFile(input, CompilerTempDir());
+    if (!inputFile) { return Return(false); }
+    inputName = inputFile->Name();
+  }
+  args.push_back(inputName.c_str());
   File* outputFile = ToOutputFile(output, CompilerTempDir());
   args.push_back("-o"); args.push_back(outputFile->Name().c_str());
   std::vector<std::string> transformed_options;
@@ -1225,38 +2877,64 @@ bool AMDGPUCompiler::CompileAndLinkExecutable(Data* input, Data* output, const s
   }
   PrintOptions(args, clangDriverName, IsInProcess());
   if (IsInProcess()) {
-    std::unique_ptr<Driver> driver(new Driver("", STRING(AMDGCN_TRIPLE), diags));
-    InitDriver(driver);
-    std::unique_ptr<Compilation> C(driver->BuildCompilation(args));
-    const JobList &Jobs = C->getJobs();
+    std::vector<PlannedJob> Jobs;
+    std::shared_ptr<JobPlan> plan = PlanJobs(args, inputName, outputFile->Name(), Jobs);
+    if (!plan) { return Return(false); }
     PrintJobs(Jobs);
     int i = 1;
     for (auto const & J : Jobs) {
       if (Jobs.size() == 2) {
-        std::string sJobName(J.getCreator().getName());
+        const std::string& sJobName = J.name;
         if (i == 1 && (sJobName == clangJobName || sJobName == clangasJobName)) {
           switch (input->Type()) {
             case DT_ASSEMBLY: {
+              std::unique_lock<std::mutex> jobLock = LLVMOptions::Instance().LockJob();
               AssemblerInvocation Asm;
               if (!PrepareAssembler(Asm, J)) { return Return(false); }
-              if (ExecuteAssembler(Asm)) { return Return(false); }
+              if (inputInMemory) {
+                Asm.InputBuffer = MemoryBuffer::getMemBufferCopy(StringRef(inputPtr, inputSize), inputName);
+              }
+              bool crashed;
+              if (!RunJobSafely(J.name, [&]() { return !ExecuteAssembler(Asm); }, crashed)) { return Return(false); }
               break;
             }
             default: {
-              CompilerInstance Clang;
-              if (!PrepareCompiler(Clang, J)) { return Return(false); }
-              if (!ExecuteCompiler(Clang, Backend_EmitObj)) { return Return(false); }
+              std::unique_lock<std::mutex> jobLock = LLVMOptions::Instance().LockJob();
+              std::unique_ptr<CompilerInstance> Clang(new CompilerInstance());
+              if (!PrepareCompiler(*Clang, J, plan.get())) { return Return(false); }
+              bool crashed;
+              bool res = RunJobSafely(J.name, [&]() { return ExecuteCompiler(*Clang, Backend_EmitObj); }, crashed);
+              // State of crashed compiler instance is unknown, so it is not freed.
+              if (IsFastTeardown() || crashed) { BuryPointer(std::move(Clang)); }
+              if (!res) { return Return(false); }
               break;
             }
           }
         } else if (i == 2 && sJobName == linkerJobName) {
-          llvm::opt::ArgStringList Args(J.getArguments());
-          Args.insert(Args.begin(), "");
-          ArrayRef<const char*> ArgRefs = llvm::makeArrayRef(Args);
-          static std::mutex m_screen;
-          m_screen.lock();
-          bool lldRet = lld::elf::link(ArgRefs, false, OS);
-          m_screen.unlock();
+          // State of lld is unknown after it crashed in this process, so
+          // later links run it out of process.
+          static std::atomic_bool lldCrashed(false);
+          if (lldCrashed) {
+            if (!InvokeTool(J.argv, llvmBin + "/ld.lld")) { return Return(false); }
+            i++;
+            continue;
+          }
+          llvm::opt::ArgStringList Args(J.argv);
+          bool lldRet;
+          {
+            // lld is not reentrant and parses -mllvm options into global LLVM
+            // options. Locked outside of crash recovery, so it is unlocked if
+            // lld crashes.
+            std::unique_lock<std::mutex> jobLock = LLVMOptions::Instance().LockJob();
+            for (size_t a = 0; a + 1 < Args.size(); ++a) {
+              if (StringRef(Args[a]) == "-mllvm") { LLVMOptions::Instance().Track(Args[a + 1]); }
+            }
+            Args.insert(Args.begin(), "");
+            ArrayRef<const char*> ArgRefs = llvm::makeArrayRef(Args);
+            bool crashed;
+            lldRet = RunJobSafely(J.name, [&]() { return lld::elf::link(ArgRefs, false, OS); }, crashed);
+            if (crashed) { lldCrashed = true; }
+          }
           if (!lldRet) { return Return(false); }
         } else { return Return(false); }
         i++;
@@ -1269,13 +2947,282 @@ bool AMDGPUCompiler::CompileAndLinkExecutable(Data* input, Data* output, const s
 }
 
 bool AMDGPUCompiler::CompileAndLinkExecutable(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) {
+  CallScope scope(this, "CompileAndLinkExecutable", inputs, output);
   if (inputs.size() == 1) {
-    return CompileAndLinkExecutable(inputs[0], output, options);
+    return scope.Result(CompileAndLinkExecutable(inputs[0], output, options));
   } else {
     File* bcFile = NewTempFile(DT_LLVM_BC);
-    if (!CompileToLLVMBitcode(inputs, bcFile, options)) { return false; }
-    return CompileAndLinkExecutable(bcFile, output, options);
+    if (!CompileToLLVMBitcode(inputs, bcFile, options, false)) { return false; }
+    return scope.Result(CompileAndLinkExecutable(bcFile, output, options));
+  }
+}
+
+bool AMDGPUCompiler::CompileAndLinkExecutables(const std::vector<Data*>& inputs, const std::vector<std::string>& targets, const std::vector<Data*>& outputs, const std::vector<std::string>& options) {
+  CallScope scope(this, "CompileAndLinkExecutables", inputs, outputs);
+  if (targets.size() != outputs.size()) {
+    if (GetLogLevel() >= LL_ERRORS) {
+      OS << "ERROR: number of targets does not match number of outputs.\n";
+    }
+    return scope.Result(Return(false));
+  }
+  std::vector<std::string> xoptions;
+  for (size_t i = 0; i < options.size(); ++i) {
+    if (options[i] == "-mcpu") { ++i; continue; }
+    if (options[i].compare(0, 6, "-mcpu=") == 0) { continue; }
+    xoptions.push_back(options[i]);
+  }
+  // Frontend is run once without target cpu.
+  File* bcFile = NewTempFile(DT_LLVM_BC);
+  if (!CompileToLLVMBitcode(inputs, bcFile, xoptions, false)) { return false; }
+  PrintPhase("CompileAndLinkExecutables", IsInProcess());
+  PhaseTimer phase("CompileAndLinkExecutables");
+  std::vector<File*> outputFiles;
+  for (Data* output : outputs) {
+    File* outputFile = ToOutputFile(output, CompilerTempDir());
+    if (!outputFile) { return Return(false); }
+    outputFiles.push_back(outputFile);
+  }
+  // Workers own all their Data, so they do not touch this compiler.
+  // In-process code generation and lld hold the job lock, as clang backend
+  // parses its options into global LLVM options on every job, so targets
+  // run in parallel out of process.
+  bool parallel = GetParallelJobs() != 1 && targets.size() > 1;
+  std::vector<std::unique_ptr<AMDGPUCompiler>> workers;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    workers.emplace_back(NewWorkerCompiler());
+    if (parallel) { workers.back()->inprocess = false; }
+  }
+  std::vector<char> results(targets.size(), 0);
+  ParallelFor(targets.size(), GetParallelJobs(), [&](size_t i) {
+    AMDGPUCompiler* worker = workers[i].get();
+    std::vector<Data*> winputs(1, worker->NewFileReference(DT_LLVM_BC, bcFile->Name()));
+    File* woutput = worker->NewFile(DT_EXECUTABLE, outputFiles[i]->Name());
+    std::vector<std::string> woptions(xoptions);
+    woptions.push_back("-mcpu=" + targets[i]);
+    results[i] = worker->CompileAndLinkExecutable(winputs, woutput, woptions);
+  });
+  bool res = true;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    OS << workers[i]->Output();
+    if (!results[i] || !outputs[i]->ReadOutputFile(outputFiles[i])) {
+      if (GetLogLevel() >= LL_ERRORS) {
+        OS << "ERROR: compilation for target '" << targets[i] << "' failed.\n";
+      }
+      res = false;
+    }
+  }
+  return scope.Result(Return(res));
+}
+
+bool AMDGPUCompiler::CompileToSpecializableLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& placeholders, const std::vector<std::string>& options) {
+  CallScope scope(this, "CompileToSpecializableLLVMBitcode", inputs, output);
+  // Each placeholder is a call to undefined function without side effects,
+  // so the optimizer can still hoist and combine uses of it.
+  std::ostringstream decls;
+  for (const std::string& name : placeholders) {
+    decls << "int " << specPlaceholderPrefix << name << "(void) __attribute__((const));\n"
+          << "#define " << name << " (" << specPlaceholderPrefix << name << "())\n";
+  }
+  const std::string declsStr = decls.str();
+  File* declsFile = NewTempFile(DT_CL_HEADER);
+  if (!declsFile || !declsFile->WriteData(declsStr.data(), declsStr.size())) { return false; }
+  std::vector<std::string> xoptions(options);
+  xoptions.push_back("-include");
+  xoptions.push_back(declsFile->Name());
+  return scope.Result(CompileToLLVMBitcode(inputs, output, xoptions));
+}
+
+bool AMDGPUCompiler::SpecializeLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& values, const std::vector<std::string>& options) {
+  CallScope scope(this, "SpecializeLLVMBitcode", inputs, output);
+  PrintPhase("SpecializeLLVMBitcode", true);
+  PhaseTimer phase("SpecializeLLVMBitcode");
+  std::vector<const char*> args;
+  for (Data* input : inputs) {
+    FileReference* inputFile = ToInputFile(input, CompilerTempDir());
+    if (!inputFile) { return Return(false); }
+    args.push_back(inputFile->Name().c_str());
+  }
+  LLVMContext context;
+  context.setDiagnosticHandler(
+      std::make_unique<AMDGPUCompilerDiagnosticHandler>(this), true);
+  std::unique_ptr<Module> M = LinkModules(args, context);
+  if (!M) { return Return(false); }
+  if (llvm::Error err = M->materializeAll()) {
+    consumeError(std::move(err));
+    return scope.Result(Return(EmitLinkerError(context, "The module to specialize cannot be loaded.")));
+  }
+  for (const std::string& v : values) {
+    std::pair<StringRef, StringRef> nv = StringRef(v).split('=');
+    int64_t value;
+    if (nv.second.getAsInteger(0, value)) {
+      return scope.Result(Return(EmitLinkerError(context, "Invalid specialization value '" + Twine(v) + "'.")));
+    }
+    Function* F = M->getFunction(specPlaceholderPrefix + nv.first.str());
+    // Placeholder may be unused or already optimized out.
+    if (!F) { continue; }
+    while (!F->use_empty()) {
+      CallInst* CI = dyn_cast<CallInst>(F->user_back());
+      if (!CI) {
+        return scope.Result(Return(EmitLinkerError(context, "Invalid use of specialization placeholder '" + nv.first + "'.")));
+      }
+      CI->replaceAllUsesWith(ConstantInt::get(CI->getType(), value, true));
+      CI->eraseFromParent();
+    }
+    F->eraseFromParent();
+  }
+  for (const Function& F : *M) {
+    if (F.getName().startswith(specPlaceholderPrefix) && !F.use_empty()) {
+      return scope.Result(Return(EmitLinkerError(context, "The value of specialization placeholder '" +
+        F.getName().substr(specPlaceholderPrefix.size()) + "' is not specified.")));
+    }
+  }
+  if (verifyModule(*M, &errs())) {
+    return scope.Result(Return(EmitLinkerError(context, "The specialized module is broken.")));
+  }
+  return scope.Result(Return(WriteModule(*M, output, options)));
+}
+
+bool AMDGPUCompiler::CompileAndLinkKernels(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& kernels, const std::vector<std::string>& options) {
+  CallScope scope(this, "CompileAndLinkKernels", inputs, output);
+  std::vector<Data*> bcInputs;
+  bool hasSources = false;
+  for (Data* input : inputs) {
+    if (input->Type() == DT_CL || input->Type() == DT_CL_HEADER) { hasSources = true; }
+  }
+  if (hasSources) {
+    File* bcFile = NewTempFile(DT_LLVM_BC);
+    if (!CompileToLLVMBitcode(inputs, bcFile, options, false)) { return false; }
+    bcInputs.push_back(bcFile);
+  } else {
+    bcInputs = inputs;
+  }
+  PrintPhase("CompileAndLinkKernels", true);
+  PhaseTimer phase("CompileAndLinkKernels");
+  std::vector<const char*> args;
+  for (Data* input : bcInputs) {
+    FileReference* inputFile = ToInputFile(input, CompilerTempDir());
+    if (!inputFile) { return Return(false); }
+    args.push_back(inputFile->Name().c_str());
+  }
+  LLVMContext context;
+  context.setDiagnosticHandler(
+      std::make_unique<AMDGPUCompilerDiagnosticHandler>(this), true);
+  std::unique_ptr<Module> M = LinkModules(args, context);
+  if (!M) { return Return(false); }
+  std::set<std::string> kernelSet(kernels.begin(), kernels.end());
+  for (const std::string& kernel : kernelSet) {
+    Function* F = M->getFunction(kernel);
+    if (!F || F->isDeclaration() || F->getCallingConv() != CallingConv::AMDGPU_KERNEL) {
+      return scope.Result(Return(EmitLinkerError(context, "The kernel '" + Twine(kernel) + "' is not found.")));
+    }
+  }
+  // Internalize other functions, so that unlisted kernels and everything
+  // used only by them is removed. Global variables are left visible.
+  legacy::PassManager PM;
+  PM.add(createInternalizePass([&](const GlobalValue& GV) {
+    if (!isa<Function>(GV)) { return true; }
+    return kernelSet.count(GV.getName().str()) != 0;
+  }));
+  PM.add(createGlobalDCEPass());
+  PM.run(*M);
+  if (verifyModule(*M, &errs())) {
+    return scope.Result(Return(EmitLinkerError(context, "The module with selected kernels is broken.")));
+  }
+  return scope.Result(Return(WriteModule(*M, output, options)));
+}
+
+// Compressed artifact container:
+//   "AMDZ", u32 version, u32 data type, u32 reserved, u64 uncompressed size,
+//   zlib stream. Integers are little endian.
+static const char artifactMagic[4] = { 'A', 'M', 'D', 'Z' };
+static const uint32_t artifactVersion = 1;
+static const size_t artifactHeaderSize = 24;
+
+bool AMDGPUCompiler::ReadData(Data* input, std::unique_ptr<MemoryBuffer>& mb, StringRef& contents) {
+  const char* ptr;
+  size_t size;
+  if (input->MemoryRef(ptr, size)) {
+    contents = StringRef(ptr, size);
+    return true;
+  }
+  FileReference* inputFile = ToInputFile(input, CompilerTempDir());
+  if (!inputFile) { return false; }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+    MemoryBuffer::getFile(inputFile->Name(), -1, false);
+  if (!buffer) {
+    OS << "ERROR: cannot read '" << inputFile->Name() << "': " << buffer.getError().message() << "\n";
+    return false;
+  }
+  mb = std::move(*buffer);
+  contents = mb->getBuffer();
+  return true;
+}
+
+bool AMDGPUCompiler::CompressArtifact(Data* input, Data* output) {
+  PrintPhase("CompressArtifact", true);
+  PhaseTimer phase("CompressArtifact");
+  if (!zlib::isAvailable()) {
+    OS << "ERROR: compression is not available.\n";
+    return Return(false);
+  }
+  std::unique_ptr<MemoryBuffer> mb;
+  StringRef contents;
+  if (!ReadData(input, mb, contents)) { return Return(false); }
+  SmallVector<char, 0> compressed;
+  compressed.resize(artifactHeaderSize);
+  memcpy(compressed.data(), artifactMagic, sizeof(artifactMagic));
+  support::endian::write32le(compressed.data() + 4, artifactVersion);
+  support::endian::write32le(compressed.data() + 8, input->Type());
+  support::endian::write32le(compressed.data() + 12, 0);
+  support::endian::write64le(compressed.data() + 16, contents.size());
+  SmallVector<char, 0> stream;
+  if (Error E = zlib::compress(contents, stream)) {
+    OS << "ERROR: compression failed: " << toString(std::move(E)) << "\n";
+    return Return(false);
+  }
+  compressed.append(stream.begin(), stream.end());
+  File* outputFile = ToOutputFile(output, CompilerTempDir());
+  if (!outputFile || !outputFile->WriteData(compressed.data(), compressed.size())) { return Return(false); }
+  return Return(output->ReadOutputFile(outputFile));
+}
+
+bool AMDGPUCompiler::DecompressArtifact(Data* input, Buffer* output) {
+  PrintPhase("DecompressArtifact", true);
+  PhaseTimer phase("DecompressArtifact");
+  if (!zlib::isAvailable()) {
+    OS << "ERROR: compression is not available.\n";
+    return Return(false);
+  }
+  std::unique_ptr<MemoryBuffer> mb;
+  StringRef contents;
+  if (!ReadData(input, mb, contents)) { return Return(false); }
+  if (contents.size() < artifactHeaderSize ||
+      memcmp(contents.data(), artifactMagic, sizeof(artifactMagic)) != 0 ||
+      support::endian::read32le(contents.data() + 4) != artifactVersion) {
+    OS << "ERROR: input is not a compressed artifact.\n";
+    return Return(false);
+  }
+  uint32_t type = support::endian::read32le(contents.data() + 8);
+  if (type != uint32_t(output->Type())) {
+    OS << "ERROR: compressed artifact type does not match output type.\n";
+    return Return(false);
+  }
+  size_t size = support::endian::read64le(contents.data() + 16);
+  // zlib cannot compress better than about 1032:1.
+  if (size / 1032 > contents.size()) {
+    OS << "ERROR: compressed artifact is corrupted.\n";
+    return Return(false);
+  }
+  std::vector<char>& buf = output->Buf();
+  buf.resize(size);
+  if (size == 0) { return Return(true); }
+  if (Error E = zlib::uncompress(contents.drop_front(artifactHeaderSize), buf.data(), size)) {
+    buf.clear();
+    OS << "ERROR: decompression failed: " << toString(std::move(E)) << "\n";
+    return Return(false);
   }
+  buf.resize(size);
+  return Return(true);
 }
 
 bool AMDGPUCompiler::DumpExecutableAsText(Buffer* exec, File* dump) {
@@ -1322,6 +3269,132 @@ bool AMDGPUCompiler::DumpExecutableAsText(Buffer* exec, File* dump) {
   return true;
 }
 
+static const char* warmUpSource =
+  "kernel void warm_up(global int* out) { out[get_global_id(0)] = get_local_id(0); }\n";
+
+void AMDGPUCompiler::WarmUp(const std::vector<std::string>& targets, const std::vector<std::string>& options) {
+  // Earlier warm-up is superseded, it finishes its current target on its
+  // own, as it only uses its worker.
+  if (warmUpThread.joinable()) {
+    *warmUpCancel = true;
+    warmUpThread.detach();
+  }
+  // Worker owns all its Data, so warm-up does not touch this compiler.
+  std::shared_ptr<AMDGPUCompiler> worker(NewWorkerCompiler());
+  std::shared_ptr<std::atomic_bool> cancel = std::make_shared<std::atomic_bool>(false);
+  warmUpCancel = cancel;
+  warmUpThread = std::thread([worker, cancel, targets, options]() {
+    std::vector<std::string> woptions(options);
+    size_t n = std::max<size_t>(targets.size(), 1);
+    for (size_t i = 0; i < n && !*cancel; ++i) {
+      if (!targets.empty()) {
+        woptions = options;
+        woptions.push_back("-mcpu=" + targets[i]);
+      }
+      // Source is written to a new temp file for each target.
+      std::vector<Data*> inputs(1, worker->NewBufferReference(DT_CL, warmUpSource, strlen(warmUpSource),
+                                                              "warm_up_" + std::to_string(i) + ".cl"));
+      worker->CompileAndLinkExecutable(inputs, worker->NewBuffer(DT_EXECUTABLE), woptions);
+    }
+  });
+}
+
+LatencyHistogram::LatencyHistogram() : count(0), sum(0), max(0) {
+  std::fill(buckets, buckets + numBuckets, 0);
+}
+
+double LatencyHistogram::BucketBound(unsigned i) {
+  return std::ldexp(0.125, i);
+}
+
+void LatencyHistogram::Add(double ms) {
+  unsigned i = 0;
+  while (i + 1 < numBuckets && ms > BucketBound(i)) { ++i; }
+  ++buckets[i];
+  ++count;
+  sum += ms;
+  if (ms > max) { max = ms; }
+}
+
+double LatencyHistogram::Quantile(double q) const {
+  if (count == 0) { return 0; }
+  uint64_t rank = uint64_t(std::ceil(q * count));
+  uint64_t seen = 0;
+  for (unsigned i = 0; i + 1 < numBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) { return std::min(BucketBound(i), max); }
+  }
+  return max;
+}
+
+static void PrintHistogram(raw_ostream& OS, const std::string& name, const std::string& label,
+                           const std::map<std::string, LatencyHistogram>& histograms) {
+  OS << "# TYPE " << name << " histogram\n";
+  for (const auto& it : histograms) {
+    const LatencyHistogram& h = it.second;
+    std::string labels = label + "=\"" + it.first + "\"";
+    uint64_t cumulative = 0;
+    for (unsigned i = 0; i + 1 < LatencyHistogram::numBuckets; ++i) {
+      cumulative += h.buckets[i];
+      OS << name << "_bucket{" << labels << ",le=\"" << format("%g", LatencyHistogram::BucketBound(i)) << "\"} " << cumulative << "\n";
+    }
+    OS << name << "_bucket{" << labels << ",le=\"+Inf\"} " << h.count << "\n";
+    OS << name << "_sum{" << labels << "} " << format("%g", h.sum) << "\n";
+    OS << name << "_count{" << labels << "} " << h.count << "\n";
+  }
+  // Quantiles are computed from buckets by Prometheus, only the maximum
+  // is exported separately.
+  OS << "# TYPE " << name << "_max gauge\n";
+  for (const auto& it : histograms) {
+    OS << name << "_max{" << label << "=\"" << it.first << "\"} " << format("%g", it.second.max) << "\n";
+  }
+}
+
+static void PrintCounters(raw_ostream& OS, const std::string& name, const std::string& label,
+                          const std::map<std::string, uint64_t>& counters) {
+  OS << "# TYPE " << name << " counter\n";
+  for (const auto& it : counters) {
+    OS << name << "{" << label << "=\"" << it.first << "\"} " << it.second << "\n";
+  }
+}
+
+std::string CompilerMetrics::ToPrometheus() const {
+  std::string text;
+  raw_string_ostream OS(text);
+  OS << "# TYPE amd_ocl_calls_total counter\n";
+  for (const auto& it : calls) {
+    auto failed = failures.find(it.first);
+    uint64_t nfailed = failed != failures.end() ? failed->second : 0;
+    OS << "amd_ocl_calls_total{api=\"" << it.first << "\",result=\"success\"} " << it.second - nfailed << "\n";
+    OS << "amd_ocl_calls_total{api=\"" << it.first << "\",result=\"failure\"} " << nfailed << "\n";
+  }
+  PrintHistogram(OS, "amd_ocl_call_latency_ms", "api", callLatency);
+  PrintHistogram(OS, "amd_ocl_phase_latency_ms", "phase", phaseLatency);
+  OS << "# TYPE amd_ocl_bytes_in_total counter\n";
+  OS << "amd_ocl_bytes_in_total " << bytesIn << "\n";
+  OS << "# TYPE amd_ocl_bytes_out_total counter\n";
+  OS << "amd_ocl_bytes_out_total " << bytesOut << "\n";
+  OS << "# TYPE amd_ocl_temp_files_total counter\n";
+  OS << "amd_ocl_temp_files_total " << tempFiles << "\n";
+  OS << "# TYPE amd_ocl_child_processes_total counter\n";
+  OS << "amd_ocl_child_processes_total " << childProcesses << "\n";
+  PrintCounters(OS, "amd_ocl_cache_hits_total", "cache", cacheHits);
+  PrintCounters(OS, "amd_ocl_cache_misses_total", "cache", cacheMisses);
+  return OS.str();
+}
+
+CompilerMetrics CompilerFactory::GetMetrics() {
+  return MetricsRegistry::Instance().Snapshot();
+}
+
+void CompilerFactory::SetMemoryBudget(size_t budget) {
+  CompileScheduler::Instance().SetBudget(budget);
+}
+
+void CompilerFactory::SetMaxCompilations(unsigned slots) {
+  CompileScheduler::Instance().SetSlots(slots);
+}
+
 Compiler* CompilerFactory::CreateAMDGPUCompiler(const std::string& llvmBin) {
   return new AMDGPUCompiler(llvmBin);
 }
@@ -3,7 +3,9 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <cassert>
+#include <cstdint>
 
 namespace amd {
 namespace opencl_driver {
@@ -30,6 +32,13 @@ enum LogLevel {
   LL_VERBOSE,
 };
 
+enum CompilePriority {
+  CP_BACKGROUND = 0,
+  CP_NORMAL,
+  CP_INTERACTIVE,
+  CP_LAST = CP_INTERACTIVE,
+};
+
 class FileReference;
 class File;
 class Compiler;
@@ -57,6 +66,10 @@ public:
   virtual FileReference* ToInputFile(File *parent) = 0;
   virtual File* ToOutputFile(File *parent) = 0;
   virtual bool ReadOutputFile(File* f) = 0;
+  /*
+   * If contents are available in memory, sets ptr and size and returns true.
+   */
+  virtual bool MemoryRef(const char*& ptr, size_t& size) const { return false; }
   Compiler* GetCompiler() { return compiler; }
 };
 
@@ -117,6 +130,7 @@ public:
   FileReference* ToInputFile(File *parent) override;
   File* ToOutputFile(File *parent) override;
   bool ReadOutputFile(File* f) override { assert(false); return false; }
+  bool MemoryRef(const char*& p, size_t& s) const override { p = ptr; s = size; return true; }
 };
 
 /*
@@ -139,6 +153,55 @@ public:
   FileReference* ToInputFile(File *parent) override;
   File* ToOutputFile(File *parent) override;
   bool ReadOutputFile(File* f) override;
+  bool MemoryRef(const char*& p, size_t& s) const override { p = buf.data(); s = buf.size(); return true; }
+};
+
+/*
+ * Statistics of the last compilation call of Compiler.
+ *
+ * Memory is measured for the whole process, so it includes memory used by
+ * other threads during the call.
+ */
+struct CompileStatistics {
+  /*
+   * Peak increase of resident memory of this process during the call, in bytes.
+   * On Linux, peak of the process is reset when the call starts while no other
+   * call runs, so it is exact. Otherwise it is exact if the process reaches its
+   * highest resident memory during the call, else it is the increase of
+   * resident memory at the end of the call.
+   */
+  size_t peakMemory;
+
+  /*
+   * Peak resident memory of child processes run during the call, in bytes.
+   * This is the peak over all children of the process, so it is an upper
+   * bound if an earlier child used more memory.
+   */
+  size_t childPeakMemory;
+
+  /*
+   * Wall time of the call, in milliseconds.
+   */
+  double wallTime;
+
+  /*
+   * Time the call waited to be admitted by compile scheduler, including
+   * waits after yielding to calls of higher priority, in milliseconds.
+   */
+  double queueTime;
+
+  /*
+   * Time the call was compiling, wallTime without queueTime, in milliseconds.
+   */
+  double compileTime;
+
+  /*
+   * Whether the call was forwarded to compile server (see
+   * CreateRemoteCompiler). Memory of forwarded calls is not measured.
+   */
+  bool remote;
+
+  CompileStatistics() : peakMemory(0), childPeakMemory(0), wallTime(0), queueTime(0), compileTime(0), remote(false) {}
 };
 
 /*
@@ -162,6 +225,11 @@ public:
    */
   virtual const std::string& Output() = 0;
 
+  /*
+   * Return statistics of the last compilation call of this compiler.
+   */
+  virtual const CompileStatistics& Statistics() = 0;
+
   /*
    * Create new FileReference with given type and pointing to file with given name.
    *
@@ -240,6 +308,107 @@ public:
    */
   virtual bool CompileAndLinkExecutable(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) = 0;
 
+  /*
+   * Compile several inputs to executable objects for several targets.
+   *
+   * Inputs are compiled to LLVM Bitcode once, then code generation and linking
+   * are run for each target, in parallel up to GetParallelJobs(). In-process
+   * code generation and linking share global LLVM options, so they run one
+   * target at a time in the process. Targets therefore run in parallel out of
+   * process, even for in-process compiler, unless GetParallelJobs() is 1
+   * (default), when they run one after another on the calling thread. Each target
+   * is a value for -mcpu (e.g. gfx803), -mcpu options are removed from options.
+   * outputs should have the same size as targets and type DT_EXECUTABLE.
+   *
+   * As the frontend runs without target cpu, sources do not see macros and
+   * features of the targets, e.g. __gfx803__ or macros of extensions which
+   * depend on the cpu. Sources relying on them should be compiled with
+   * CompileAndLinkExecutable for each target.
+   *
+   * Returns true on success or false on failure.
+   */
+  virtual bool CompileAndLinkExecutables(const std::vector<Data*>& inputs, const std::vector<std::string>& targets, const std::vector<Data*>& outputs, const std::vector<std::string>& options) = 0;
+
+  /*
+   * Compile several inputs to LLVM Bitcode with specialization placeholders.
+   *
+   * Each name in placeholders is defined as a macro of type int whose value is
+   * not known to the frontend. Values are substituted later with
+   * SpecializeLLVMBitcode, without running the frontend again. Placeholders
+   * may be used where an int expression is allowed, but not in preprocessor
+   * conditions or where a constant expression is required.
+   *
+   * Inputs and output are the same as for CompileToLLVMBitcode.
+   *
+   * Returns true on success or false on failure.
+   */
+  virtual bool CompileToSpecializableLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& placeholders, const std::vector<std::string>& options) = 0;
+
+  /*
+   * Substitute values of specialization placeholders in LLVM Bitcode.
+   *
+   * Each input should have one of types DT_LLVM_BC, DT_LLVM_LL, inputs are linked.
+   * Each value has form NAME=VALUE, as for -D option.
+   * output should have one of types DT_LLVM_BC or DT_EXECUTABLE. For DT_EXECUTABLE,
+   * the specialized module is optimized and compiled with options, which should
+   * include an optimization level.
+   *
+   * Returns true on success or false on failure.
+   */
+  virtual bool SpecializeLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& values, const std::vector<std::string>& options) = 0;
+
+  /*
+   * Compile several inputs to executable object with only the given kernels.
+   *
+   * Inputs are the same as for CompileAndLinkExecutable. Kernels that are not
+   * listed, and functions used only by them, are removed before code generation.
+   * When inputs are the bitcode produced with CompileToLLVMBitcode, more kernels
+   * can be materialized later into a new executable without running the
+   * frontend again.
+   * output should have one of types DT_EXECUTABLE or DT_LLVM_BC.
+   *
+   * Returns true on success or false on failure.
+   */
+  virtual bool CompileAndLinkKernels(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& kernels, const std::vector<std::string>& options) = 0;
+
+  /*
+   * Compress input of any type into compressed artifact container, e.g. to
+   * persist executables or LLVM Bitcode on disk.
+   *
+   * The container records the type of input. output may be a File or Buffer.
+   *
+   * Returns true on success or false on failure.
+   */
+  virtual bool CompressArtifact(Data* input, Data* output) = 0;
+
+  /*
+   * Decompress compressed artifact container created with CompressArtifact.
+   *
+   * Contents are decompressed directly into output storage. output should have
+   * the type recorded in the container.
+   *
+   * Returns true on success or false on failure.
+   */
+  virtual bool DecompressArtifact(Data* input, Buffer* output) = 0;
+
+  /*
+   * Warm up compiler on a background thread, e.g. at application start, to
+   * hide latency of the first compilation.
+   *
+   * A trivial kernel is compiled to executable with options for each of
+   * targets, which are GPU names like "gfx900", or once for the target of
+   * options if targets are empty. This loads builtin headers and pages in
+   * code and data of the compiler. Results are discarded.
+   *
+   * The next compilation call of this compiler does not wait for warm-up. It
+   * runs concurrently with warm-up of the current target, and warm-up of the
+   * remaining targets is skipped. Destructor of this compiler waits until
+   * warm-up of the current target finishes. WarmUp called again does not wait,
+   * it skips remaining targets of the earlier warm-up, which finishes its
+   * current target in background.
+   */
+  virtual void WarmUp(const std::vector<std::string>& targets, const std::vector<std::string>& options) = 0;
+
   /*
    * Dumps Executable as text to the specified file.
    */
@@ -284,6 +453,234 @@ public:
   * Gets logging level.
   */
   virtual LogLevel GetLogLevel() = 0;
+
+  /*
+  * Enables or disables compact LLVM Bitcode outputs.
+  *
+  * DT_LLVM_BC outputs of CompileToLLVMBitcode, LinkLLVMBitcode and other calls
+  * producing LLVM Bitcode are written without debug info, local value names
+  * (except kernel argument names) and unused declarations. Such bitcode is
+  * only good for code generation.
+  */
+  virtual void SetCompactBitcode(bool bcompact = true) = 0;
+
+  /*
+  * Checks whether LLVM Bitcode outputs are compact.
+  */
+  virtual bool IsCompactBitcode() = 0;
+
+  /*
+  * Enables or disables writing module summary index into DT_LLVM_BC outputs.
+  */
+  virtual void SetBitcodeSummary(bool bsummary = true) = 0;
+
+  /*
+  * Checks whether module summary index is written into LLVM Bitcode outputs.
+  */
+  virtual bool IsBitcodeSummary() = 0;
+
+  /*
+  * Enables or disables fast teardown of in-process compilations.
+  *
+  * Frontend state, LLVM contexts and modules of in-process jobs are not freed,
+  * as with clang -disable-free. Memory is leaked with each compilation, so it
+  * is only suitable for short-lived processes. Modules of links in pooled
+  * contexts are still freed, as the context is reused.
+  */
+  virtual void SetFastTeardown(bool bfastteardown = true) = 0;
+
+  /*
+  * Checks whether fast teardown of in-process compilations is enabled.
+  */
+  virtual bool IsFastTeardown() = 0;
+
+  /*
+  * Enables or disables pooling of LLVM contexts for in-process linking.
+  *
+  * Each thread keeps LLVM context which is reused by its in-process links
+  * instead of creating a new one for each link. Context is recreated after
+  * a number of links, as types and constants accumulate in it.
+  */
+  virtual void SetContextPooling(bool bcontextpooling = true) = 0;
+
+  /*
+  * Checks whether pooling of LLVM contexts is enabled.
+  */
+  virtual bool IsContextPooling() = 0;
+
+  /*
+  * Enables or disables keeping modules of libraries resident in pooled
+  * LLVM contexts.
+  *
+  * Input of in-process link which was already linked on the same thread,
+  * as identified by hash of its contents, is kept loaded in the pooled
+  * context and its copy is linked instead of loading it again. Enables
+  * context pooling.
+  */
+  virtual void SetResidentLibraries(bool bresidentlibs = true) = 0;
+
+  /*
+  * Checks whether modules of libraries are kept resident.
+  */
+  virtual bool IsResidentLibraries() = 0;
+
+  /*
+  * Enables or disables crash recovery of in-process compilations.
+  *
+  * Each in-process clang, assembler and lld job runs under LLVM crash
+  * recovery on its own thread with large stack, in-process linking of LLVM
+  * Bitcode on calling thread. If job crashes, the call returns false with
+  * error in compiler output instead of aborting the process. Memory of the
+  * crashed job is not freed. After lld crashed, later links run lld out of
+  * process.
+  *
+  * Crash recovery replaces process-wide handlers of crash signals (SIGSEGV,
+  * SIGBUS, SIGILL and others) while jobs under it run. Handlers of the host
+  * application are restored when no such job is running.
+  */
+  virtual void SetCrashRecovery(bool bcrashrecovery = true) = 0;
+
+  /*
+  * Checks whether crash recovery of in-process compilations is enabled.
+  */
+  virtual bool IsCrashRecovery() = 0;
+
+  /*
+  * Sets timeout of each compilation call in milliseconds, 0 for no timeout.
+  *
+  * Child processes still running when timeout expires are killed. Children
+  * are waited for by polling, without signals, so timeouts of concurrent
+  * calls and signal handlers of the host application do not interfere.
+  * Clang driver jobs are killed only on Linux. In-process jobs are aborted at the next phase
+  * or pass boundary, running under crash recovery, so their memory is not
+  * freed. The call then fails with timeout error in compiler output.
+  */
+  virtual void SetTimeout(unsigned ms) = 0;
+
+  /*
+  * Gets timeout of compilation calls in milliseconds, 0 if there is none.
+  */
+  virtual unsigned GetTimeout() = 0;
+
+  /*
+  * Sets priority of compilation calls of this compiler (default CP_NORMAL).
+  *
+  * Waiting calls are admitted by compile scheduler in order of priority,
+  * then arrival. Running call yields at its next phase boundary to a
+  * waiting call of higher priority and waits to be admitted again.
+  */
+  virtual void SetPriority(CompilePriority priority) = 0;
+
+  /*
+  * Gets priority of compilation calls.
+  */
+  virtual CompilePriority GetPriority() = 0;
+
+  /*
+  * Enables or disables link-time optimization of compilations with several
+  * sources into executables.
+  *
+  * Linked module is optimized across translation units before code
+  * generation: functions other than kernels are internalized, so that they
+  * can be inlined into kernels and removed, then the module is optimized
+  * at the level of -O options. Global variables are left visible.
+  */
+  virtual void SetLinkTimeOptimization(bool blto = true) = 0;
+
+  /*
+  * Checks whether link-time optimization is enabled.
+  */
+  virtual bool IsLinkTimeOptimization() = 0;
+
+  /*
+  * Sets maximum number of jobs of one call run in parallel on worker threads,
+  * 0 for the number of hardware threads. Default is 1, jobs then run one
+  * after another on the calling thread.
+  *
+  * In-process jobs share global LLVM options, so they run one at a time in
+  * the process and parallel jobs mostly benefit out-of-process compilation.
+  */
+  virtual void SetParallelJobs(unsigned n) = 0;
+
+  /*
+  * Gets maximum number of parallel jobs of one call.
+  */
+  virtual unsigned GetParallelJobs() = 0;
+};
+
+/*
+ * Histogram of latencies in milliseconds with exponential buckets.
+ */
+struct LatencyHistogram {
+  static const unsigned numBuckets = 24;
+
+  /*
+   * Number of samples in each bucket. Bucket i holds latencies up to
+   * BucketBound(i) and above the bound of bucket i - 1, the last bucket
+   * is unbounded.
+   */
+  uint64_t buckets[numBuckets];
+  uint64_t count;
+  double sum;
+  double max;
+
+  LatencyHistogram();
+
+  /*
+   * Upper bound of bucket i, 0.125 ms * 2^i.
+   */
+  static double BucketBound(unsigned i);
+
+  void Add(double ms);
+
+  /*
+   * Latency below which fraction q of samples fall, e.g. 0.5 or 0.99.
+   * Estimated by the upper bound of the bucket, or max if it is lower.
+   */
+  double Quantile(double q) const;
+};
+
+/*
+ * Snapshot of cumulative metrics of all compilers in this process.
+ */
+struct CompilerMetrics {
+  /*
+   * Calls of each Compiler compilation API, e.g. "CompileAndLinkExecutable",
+   * failed calls and call latencies. Calls of compile server are counted
+   * by the server process.
+   */
+  std::map<std::string, uint64_t> calls;
+  std::map<std::string, uint64_t> failures;
+  std::map<std::string, LatencyHistogram> callLatency;
+
+  /*
+   * Latencies of compilation phases, e.g. "CompileToLLVMBitcode" for the
+   * frontend of one input or "LinkLLVMBitcode".
+   */
+  std::map<std::string, LatencyHistogram> phaseLatency;
+
+  /*
+   * Bytes of inputs and outputs of compilation calls.
+   */
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+
+  uint64_t tempFiles;
+  uint64_t childProcesses;
+
+  /*
+   * Hits and misses of internal caches, "job_plans", "resident_libraries"
+   * and "header_sets".
+   */
+  std::map<std::string, uint64_t> cacheHits;
+  std::map<std::string, uint64_t> cacheMisses;
+
+  CompilerMetrics() : bytesIn(0), bytesOut(0), tempFiles(0), childProcesses(0) {}
+
+  /*
+   * Metrics in Prometheus text exposition format.
+   */
+  std::string ToPrometheus() const;
 };
 
 /*
@@ -300,6 +697,62 @@ public:
    * Create new instance of OpenCL compiler with AMDGPU backend.
    */
   Compiler* CreateAMDGPUCompiler(const std::string& llvmBin);
+
+  /*
+   * Create new instance of OpenCL compiler that forwards compilation to compile
+   * server listening on Unix domain socket socketPath (see RunCompileServer).
+   *
+   * Data is managed locally. If the server is not available, compilation is
+   * done locally with AMDGPU backend.
+   */
+  Compiler* CreateRemoteCompiler(const std::string& llvmBin, const std::string& socketPath);
+
+  /*
+   * Serve compilation requests on Unix domain socket socketPath.
+   *
+   * Requests are run on warm compilers. Identical requests from different
+   * clients are run once, and their results are kept compressed (see
+   * CompressArtifact) in a cache shared by all clients of up to cacheSize
+   * bytes. Requests reading files of the
+   * host, through options such as -I or -include or includes of files that
+   * are not inputs, are not cached. Relative paths in options are relative
+   * to the working directory of the client.
+   *
+   * The socket is accessible only to the user running the server, and only
+   * clients of that user are served, up to 64 at a time. An existing file
+   * at socketPath is replaced only if it is a socket.
+   *
+   * Compilers of the server run with crash recovery, so a crashing request
+   * fails without stopping the server.
+   *
+   * Returns true when the socket is removed or replaced, e.g. by a newer
+   * server, or false if the socket cannot be created.
+   */
+  bool RunCompileServer(const std::string& llvmBin, const std::string& socketPath, size_t cacheSize = 256 << 20);
+
+  /*
+   * Limit memory of concurrent compilations by all compilers in this process
+   * to budget bytes, 0 for no limit (default, or AMD_OCL_MEMORY_BUDGET in MB).
+   *
+   * Each compilation is estimated to need the average peak memory of recent
+   * compilations. A compilation waits until its estimate fits in the budget
+   * together with running ones. One compilation is always admitted.
+   */
+  void SetMemoryBudget(size_t budget);
+
+  /*
+   * Limit number of concurrent compilations by all compilers in this process
+   * to slots, 0 for no limit (default, or AMD_OCL_MAX_COMPILATIONS).
+   *
+   * Compilations over the limit wait to be admitted in order of priority set
+   * with Compiler::SetPriority.
+   */
+  void SetMaxCompilations(unsigned slots);
+
+  /*
+   * Snapshot of cumulative metrics of all compilers in this process.
+   */
+  CompilerMetrics GetMetrics();
 };
 
 }
@@ -0,0 +1,799 @@
+#include "AmdCompiler.h"
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace amd {
+namespace opencl_driver {
+
+/*
+ * Compile server protocol.
+ *
+ * Each message is 64-bit length followed by payload. Request payload is
+ * magic, version, action, output type, working directory of the client,
+ * options and inputs (type, id and contents). Response payload is status,
+ * compiler log and output contents.
+ * Integers are 32-bit and strings are 32-bit length followed by bytes,
+ * all in host byte order as both ends are on the same host.
+ */
+namespace {
+
+const uint32_t ServerMagic = 0x53434F41; // "AOCS"
+const uint32_t ServerVersion = 2;
+// Larger messages are rejected, e.g. to not let a client exhaust memory of
+// the server. Requests which would be larger are compiled locally.
+const uint64_t MaxMessageSize = 256 << 20;
+
+enum ServerAction {
+  SA_CompileToLLVMBitcode = 1,
+  SA_LinkLLVMBitcode,
+  SA_CompileAndLinkExecutable,
+};
+
+class MessageWriter {
+private:
+  std::string buf;
+
+public:
+  void U32(uint32_t v) { buf.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+  void Str(const char* ptr, size_t size) { U32(size); buf.append(ptr, size); }
+  void Str(const std::string& s) { Str(s.data(), s.size()); }
+  const std::string& Buf() const { return buf; }
+};
+
+class MessageReader {
+private:
+  const char* ptr;
+  const char* end;
+
+public:
+  MessageReader(const std::string& msg)
+    : ptr(msg.data()), end(msg.data() + msg.size()) {}
+
+  bool U32(uint32_t& v) {
+    if (size_t(end - ptr) < sizeof(v)) { return false; }
+    memcpy(&v, ptr, sizeof(v));
+    ptr += sizeof(v);
+    return true;
+  }
+
+  // Returns reference to the contents of the message.
+  bool Str(const char*& p, size_t& size) {
+    uint32_t n;
+    if (!U32(n) || size_t(end - ptr) < n) { return false; }
+    p = ptr; size = n;
+    ptr += n;
+    return true;
+  }
+
+  bool Str(std::string& s) {
+    const char* p; size_t size;
+    if (!Str(p, size)) { return false; }
+    s.assign(p, size);
+    return true;
+  }
+};
+
+struct ServerRequest {
+  struct Input {
+    uint32_t type;
+    std::string id;
+    // Contents in the request message.
+    const char* ptr;
+    size_t size;
+  };
+
+  uint32_t action;
+  uint32_t outputType;
+  std::string cwd;
+  std::vector<std::string> options;
+  std::vector<Input> inputs;
+};
+
+bool ParseRequest(const std::string& msg, ServerRequest& req) {
+  MessageReader reader(msg);
+  uint32_t magic, version, n;
+  if (!reader.U32(magic) || magic != ServerMagic ||
+      !reader.U32(version) || version != ServerVersion ||
+      !reader.U32(req.action) || !reader.U32(req.outputType) ||
+      !reader.Str(req.cwd) || !reader.U32(n)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < n; ++i) {
+    std::string option;
+    if (!reader.Str(option)) { return false; }
+    req.options.push_back(option);
+  }
+  if (!reader.U32(n)) { return false; }
+  for (uint32_t i = 0; i < n; ++i) {
+    ServerRequest::Input input;
+    if (!reader.U32(input.type) || !reader.Str(input.id) || !reader.Str(input.ptr, input.size)) { return false; }
+    req.inputs.push_back(input);
+  }
+  return true;
+}
+
+// Options naming a file or directory, as separate or joined argument.
+const char* const PathOptions[] = { "-I", "-include", "-imacros", "-isystem", "-iquote", "-idirafter" };
+
+// Make relative paths in options relative to the working directory of the
+// client, as the server runs in its own.
+void ResolvePaths(std::vector<std::string>& options, const std::string& cwd) {
+  auto resolve = [&](std::string& option, size_t pos) {
+    if (cwd.empty() || pos >= option.size() || option[pos] == '/') { return; }
+    option.insert(pos, cwd + "/");
+  };
+  for (size_t i = 0; i < options.size(); ++i) {
+    for (const char* name : PathOptions) {
+      size_t len = strlen(name);
+      if (options[i] == name) {
+        if (i + 1 < options.size()) { resolve(options[++i], 0); }
+        break;
+      }
+      if (options[i].compare(0, len, name) == 0) {
+        resolve(options[i], len);
+        break;
+      }
+    }
+  }
+}
+
+// Whether sources include a file which is not one of header inputs.
+bool IncludesFiles(const ServerRequest& req) {
+  std::set<std::string> headers;
+  for (const ServerRequest::Input& input : req.inputs) {
+    if (input.type == DT_CL_HEADER) { headers.insert(input.id); }
+  }
+  for (const ServerRequest::Input& input : req.inputs) {
+    if (input.type != DT_CL && input.type != DT_CL_HEADER) { continue; }
+    std::string text(input.ptr, input.size);
+    if (text.find("__has_include") != std::string::npos) { return true; }
+    for (size_t pos = text.find('#'); pos != std::string::npos; pos = text.find('#', pos + 1)) {
+      size_t p = text.find_first_not_of(" \t", pos + 1);
+      if (p == std::string::npos) { break; }
+      if (text.compare(p, 7, "include") != 0 && text.compare(p, 6, "import") != 0) { continue; }
+      p = text.find_first_of(" \t<\"", p);
+      p = p == std::string::npos ? p : text.find_first_not_of(" \t", p);
+      // Include of macro is treated as include of a file.
+      if (p == std::string::npos || (text[p] != '<' && text[p] != '"')) { return true; }
+      size_t end = text.find(text[p] == '<' ? '>' : '"', p + 1);
+      if (end == std::string::npos || !headers.count(text.substr(p + 1, end - p - 1))) { return true; }
+    }
+  }
+  return false;
+}
+
+// Whether response depends only on the request. Options referencing files
+// and includes of files which are not inputs read files of the host, which
+// may change between requests.
+bool IsCacheable(const ServerRequest& req) {
+  for (const std::string& option : req.options) {
+    if (option.compare(0, 2, "-I") == 0 || option.compare(0, 2, "-i") == 0 ||
+        option.compare(0, 1, "@") == 0 || option.compare(0, 9, "--sysroot") == 0 ||
+        option.compare(0, 2, "-X") == 0 || option.compare(0, 4, "-Wl,") == 0 ||
+        option.compare(0, 6, "-mlink") == 0 || option.compare(0, 9, "-fprofile") == 0) {
+      return false;
+    }
+  }
+  return !IncludesFiles(req);
+}
+
+#ifndef _WIN32
+
+bool WriteAll(int fd, const char* ptr, size_t size) {
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+  while (size > 0) {
+    ssize_t n = send(fd, ptr, size, flags);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { return false; }
+    ptr += n; size -= n;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, char* ptr, size_t size) {
+  while (size > 0) {
+    ssize_t n = recv(fd, ptr, size, 0);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { return false; }
+    ptr += n; size -= n;
+  }
+  return true;
+}
+
+bool SendMessage(int fd, const std::string& msg) {
+  uint64_t size = msg.size();
+  return WriteAll(fd, reinterpret_cast<const char*>(&size), sizeof(size)) &&
+         WriteAll(fd, msg.data(), msg.size());
+}
+
+bool ReceiveMessage(int fd, std::string& msg) {
+  uint64_t size;
+  if (!ReadAll(fd, reinterpret_cast<char*>(&size), sizeof(size))) { return false; }
+  if (size > MaxMessageSize) { return false; }
+  msg.resize(size);
+  return size == 0 || ReadAll(fd, &msg[0], size);
+}
+
+bool MakeAddress(const std::string& socketPath, sockaddr_un& addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path)) { return false; }
+  strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+  return true;
+}
+
+// Whether peer of connected socket runs as the same user as this process.
+bool IsSameUser(int fd) {
+#ifdef SO_PEERCRED
+  ucred cred;
+  socklen_t size = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0) { return false; }
+  return cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) != 0) { return false; }
+  return uid == geteuid();
+#endif
+}
+
+#endif // _WIN32
+
+}
+
+/*
+ * RemoteCompiler forwards compilation calls to compile server. Everything
+ * else, including Data management, is done by local compiler.
+ */
+class RemoteCompiler : public Compiler {
+private:
+  std::unique_ptr<Compiler> local;
+  std::string socketPath;
+  std::string output;
+  std::string remoteLog;
+  int fd;
+  // Statistics of the last call if it was forwarded.
+  CompileStatistics remoteStats;
+  bool forwarded;
+
+  bool Connect();
+  void Disconnect();
+  bool Forward(ServerAction action, const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool& res);
+  bool IsDefaultBitcode() { return !local->IsCompactBitcode() && !local->IsBitcodeSummary(); }
+  // Server does not enforce timeout of this compiler.
+  bool HasTimeout() { return local->GetTimeout() != 0; }
+  // Server does not know code generation settings of this compiler.
+  bool IsDefaultCodeGen() { return !local->IsLinkTimeOptimization(); }
+
+public:
+  RemoteCompiler(Compiler* local_, const std::string& socketPath_)
+    : local(local_), socketPath(socketPath_), fd(-1), forwarded(false) {}
+
+  ~RemoteCompiler() { Disconnect(); }
+
+  const std::string& Output() override {
+    output = remoteLog;
+    remoteLog.clear();
+    output += local->Output();
+    return output;
+  }
+
+  const CompileStatistics& Statistics() override { return forwarded ? remoteStats : local->Statistics(); }
+
+  FileReference* NewFileReference(DataType type, const std::string& name, File* parent = 0) override {
+    return local->NewFileReference(type, name, parent);
+  }
+
+  File* NewFile(DataType type, const std::string& name, File* parent = 0) override {
+    return local->NewFile(type, name, parent);
+  }
+
+  File* NewTempFile(DataType type, const std::string& name = "", File* parent = 0) override {
+    return local->NewTempFile(type, name, parent);
+  }
+
+  File* NewTempDir(File* parent = 0) override { return local->NewTempDir(parent); }
+
+  BufferReference* NewBufferReference(DataType type, const char* ptr, size_t size, const std::string& id = "") override {
+    return local->NewBufferReference(type, ptr, size, id);
+  }
+
+  Buffer* NewBuffer(DataType type) override { return local->NewBuffer(type); }
+
+  bool CompileToLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) override {
+    bool res;
+    // Server does not know bitcode settings of this compiler.
+    if (!IsDefaultBitcode() || HasTimeout()) { forwarded = false; return local->CompileToLLVMBitcode(inputs, output, options); }
+    if (Forward(SA_CompileToLLVMBitcode, inputs, output, options, res)) { return res; }
+    return local->CompileToLLVMBitcode(inputs, output, options);
+  }
+
+  bool LinkLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) override {
+    bool res;
+    if (!IsDefaultBitcode() || HasTimeout()) { forwarded = false; return local->LinkLLVMBitcode(inputs, output, options); }
+    if (Forward(SA_LinkLLVMBitcode, inputs, output, options, res)) { return res; }
+    return local->LinkLLVMBitcode(inputs, output, options);
+  }
+
+  bool CompileAndLinkExecutable(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options) override {
+    bool res;
+    if (!IsDefaultCodeGen() || HasTimeout()) { forwarded = false; return local->CompileAndLinkExecutable(inputs, output, options); }
+    if (Forward(SA_CompileAndLinkExecutable, inputs, output, options, res)) { return res; }
+    return local->CompileAndLinkExecutable(inputs, output, options);
+  }
+
+  bool CompileAndLinkExecutables(const std::vector<Data*>& inputs, const std::vector<std::string>& targets, const std::vector<Data*>& outputs, const std::vector<std::string>& options) override {
+    forwarded = false;
+    return local->CompileAndLinkExecutables(inputs, targets, outputs, options);
+  }
+
+  bool CompileToSpecializableLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& placeholders, const std::vector<std::string>& options) override {
+    forwarded = false;
+    return local->CompileToSpecializableLLVMBitcode(inputs, output, placeholders, options);
+  }
+
+  bool SpecializeLLVMBitcode(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& values, const std::vector<std::string>& options) override {
+    forwarded = false;
+    return local->SpecializeLLVMBitcode(inputs, output, values, options);
+  }
+
+  bool CompileAndLinkKernels(const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& kernels, const std::vector<std::string>& options) override {
+    forwarded = false;
+    return local->CompileAndLinkKernels(inputs, output, kernels, options);
+  }
+
+  bool CompressArtifact(Data* input, Data* output) override { return local->CompressArtifact(input, output); }
+
+  bool DecompressArtifact(Data* input, Buffer* output) override { return local->DecompressArtifact(input, output); }
+
+  // Warms up local compiler used when server is not available.
+  void WarmUp(const std::vector<std::string>& targets, const std::vector<std::string>& options) override { local->WarmUp(targets, options); }
+
+  bool DumpExecutableAsText(Buffer* exec, File* dump) override { return local->DumpExecutableAsText(exec, dump); }
+
+  void SetInProcess(bool binprocess = true) override { local->SetInProcess(binprocess); }
+
+  bool IsInProcess() override { return local->IsInProcess(); }
+
+  void SetKeepTmp(bool bkeeptmp = true) override { local->SetKeepTmp(bkeeptmp); }
+
+  bool IsKeepTmp() override { return local->IsKeepTmp(); }
+
+  void SetPrintLog(bool bprintlog = true) override { local->SetPrintLog(bprintlog); }
+
+  bool IsPrintLog() override { return local->IsPrintLog(); }
+
+  void SetLogLevel(LogLevel ll) override { local->SetLogLevel(ll); }
+
+  LogLevel GetLogLevel() override { return local->GetLogLevel(); }
+
+  void SetCompactBitcode(bool bcompact = true) override { local->SetCompactBitcode(bcompact); }
+
+  bool IsCompactBitcode() override { return local->IsCompactBitcode(); }
+
+  void SetBitcodeSummary(bool bsummary = true) override { local->SetBitcodeSummary(bsummary); }
+
+  bool IsBitcodeSummary() override { return local->IsBitcodeSummary(); }
+
+  void SetFastTeardown(bool bfastteardown = true) override { local->SetFastTeardown(bfastteardown); }
+
+  bool IsFastTeardown() override { return local->IsFastTeardown(); }
+
+  void SetContextPooling(bool bcontextpooling = true) override { local->SetContextPooling(bcontextpooling); }
+
+  bool IsContextPooling() override { return local->IsContextPooling(); }
+
+  void SetResidentLibraries(bool bresidentlibs = true) override { local->SetResidentLibraries(bresidentlibs); }
+
+  bool IsResidentLibraries() override { return local->IsResidentLibraries(); }
+
+  void SetCrashRecovery(bool bcrashrecovery = true) override { local->SetCrashRecovery(bcrashrecovery); }
+
+  bool IsCrashRecovery() override { return local->IsCrashRecovery(); }
+
+  void SetTimeout(unsigned ms) override { local->SetTimeout(ms); }
+
+  unsigned GetTimeout() override { return local->GetTimeout(); }
+
+  void SetPriority(CompilePriority priority) override { local->SetPriority(priority); }
+
+  CompilePriority GetPriority() override { return local->GetPriority(); }
+
+  void SetLinkTimeOptimization(bool blto = true) override { local->SetLinkTimeOptimization(blto); }
+
+  bool IsLinkTimeOptimization() override { return local->IsLinkTimeOptimization(); }
+
+  void SetParallelJobs(unsigned n) override { local->SetParallelJobs(n); }
+
+  unsigned GetParallelJobs() override { return local->GetParallelJobs(); }
+};
+
+#ifndef _WIN32
+
+bool RemoteCompiler::Connect() {
+  if (fd >= 0) { return true; }
+  sockaddr_un addr;
+  if (!MakeAddress(socketPath, addr)) { return false; }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) { return false; }
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
+void RemoteCompiler::Disconnect() {
+  if (fd >= 0) { close(fd); }
+  fd = -1;
+}
+
+// Returns false if the request cannot be served remotely.
+bool RemoteCompiler::Forward(ServerAction action, const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool& res) {
+  forwarded = false;
+  if (!Connect()) { return false; }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  MessageWriter request;
+  request.U32(ServerMagic);
+  request.U32(ServerVersion);
+  request.U32(action);
+  request.U32(output->Type());
+  char cwd[PATH_MAX];
+  request.Str(getcwd(cwd, sizeof(cwd)) ? cwd : "");
+  request.U32(options.size());
+  for (const std::string& option : options) { request.Str(option); }
+  request.U32(inputs.size());
+  for (Data* input : inputs) {
+    request.U32(input->Type());
+    request.Str(input->Id());
+    const char* ptr;
+    size_t size;
+    std::string contents;
+    if (!input->MemoryRef(ptr, size)) {
+      FileReference* inputFile = input->ToInputFile(0);
+      if (!inputFile || !inputFile->ReadToString(contents)) { return false; }
+      ptr = contents.data();
+      size = contents.size();
+    }
+    request.Str(ptr, size);
+  }
+  if (request.Buf().size() > MaxMessageSize) { return false; }
+  std::string response;
+  if (!SendMessage(fd, request.Buf()) || !ReceiveMessage(fd, response)) {
+    Disconnect();
+    return false;
+  }
+  MessageReader reader(response);
+  uint32_t status;
+  std::string log;
+  const char* ptr;
+  size_t size;
+  if (!reader.U32(status) || !reader.Str(log) || !reader.Str(ptr, size)) {
+    Disconnect();
+    return false;
+  }
+  remoteLog += log;
+  res = status != 0;
+  if (res) {
+    File* outputFile = output->ToOutputFile(0);
+    res = outputFile && outputFile->WriteData(ptr, size) && output->ReadOutputFile(outputFile);
+  }
+  // Memory is used by the server.
+  remoteStats = CompileStatistics();
+  remoteStats.wallTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  remoteStats.compileTime = remoteStats.wallTime;
+  remoteStats.remote = true;
+  forwarded = true;
+  return true;
+}
+
+#else // _WIN32
+
+bool RemoteCompiler::Connect() { return false; }
+void RemoteCompiler::Disconnect() {}
+bool RemoteCompiler::Forward(ServerAction action, const std::vector<Data*>& inputs, Data* output, const std::vector<std::string>& options, bool& res) { forwarded = false; return false; }
+
+#endif // _WIN32
+
+Compiler* CompilerFactory::CreateRemoteCompiler(const std::string& llvmBin, const std::string& socketPath) {
+  return new RemoteCompiler(CreateAMDGPUCompiler(llvmBin), socketPath);
+}
+
+#ifndef _WIN32
+
+class CompileServer {
+private:
+  struct CacheEntry {
+    // Response of request in progress.
+    std::shared_future<std::string> response;
+    // Response of completed request, compressed artifact if compressed.
+    std::string data;
+    bool compressed;
+    size_t size;
+    std::list<const std::string*>::iterator lru;
+  };
+
+  std::string llvmBin;
+  size_t cacheSize;
+  std::mutex m;
+  // Warm compilers are reused, but recreated periodically, as Data of
+  // all requests is kept until compiler is destroyed.
+  std::vector<std::pair<std::unique_ptr<Compiler>, unsigned>> idle;
+  const unsigned compilerUses = 64;
+  // Connections beyond the limit are closed, their clients compile locally.
+  std::atomic_uint clients;
+  const unsigned maxClients = 64;
+  // Requests (keys) in progress or completed, and completed ones from least
+  // to most recently used.
+  std::map<std::string, CacheEntry> cache;
+  std::list<const std::string*> lru;
+  size_t cacheBytes;
+
+  std::string Execute(const ServerRequest& req);
+  std::string Handle(const std::string& request);
+  // Completed responses are cached compressed with CompressArtifact, as
+  // executables and bitcode compress well. Returns false if compressed
+  // response would not be smaller.
+  bool Compress(const std::string& response, std::string& compressed);
+  bool Decompress(const std::string& compressed, std::string& response);
+  void Evict();
+
+public:
+  CompileServer(const std::string& llvmBin_, size_t cacheSize_)
+    : llvmBin(llvmBin_), cacheSize(cacheSize_), clients(0), cacheBytes(0) {}
+
+  // Returns false if the client cannot be served, closing its connection.
+  bool Accept(int client);
+
+  void Serve(int client);
+};
+
+std::string CompileServer::Execute(const ServerRequest& req) {
+  std::pair<std::unique_ptr<Compiler>, unsigned> compiler;
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (!idle.empty()) {
+      compiler = std::move(idle.back());
+      idle.pop_back();
+    }
+  }
+  if (!compiler.first) {
+    CompilerFactory compilerFactory;
+    compiler.first.reset(compilerFactory.CreateAMDGPUCompiler(llvmBin));
+    // Crashing request fails instead of taking down the server.
+    compiler.first->SetCrashRecovery(true);
+    compiler.second = 0;
+  }
+  Compiler* c = compiler.first.get();
+
+  MessageWriter response;
+  std::vector<std::string> options(req.options);
+  ResolvePaths(options, req.cwd);
+  std::vector<Data*> inputs;
+  for (const ServerRequest::Input& input : req.inputs) {
+    inputs.push_back(c->NewBufferReference(DataType(input.type), input.ptr, input.size, input.id));
+  }
+  bool res = false;
+  Buffer* output = c->NewBuffer(DataType(req.outputType));
+  if (output) {
+    switch (req.action) {
+      case SA_CompileToLLVMBitcode: res = c->CompileToLLVMBitcode(inputs, output, options); break;
+      case SA_LinkLLVMBitcode: res = c->LinkLLVMBitcode(inputs, output, options); break;
+      case SA_CompileAndLinkExecutable: res = c->CompileAndLinkExecutable(inputs, output, options); break;
+      default: break;
+    }
+  }
+  response.U32(res ? 1 : 0);
+  response.Str(c->Output());
+  if (res) {
+    response.Str(output->Ptr(), output->Size());
+  } else {
+    response.Str("");
+  }
+
+  // Compiler of failed request, which may have crashed, is not reused.
+  if (res && ++compiler.second < compilerUses) {
+    std::lock_guard<std::mutex> lock(m);
+    idle.push_back(std::move(compiler));
+  }
+  return response.Buf();
+}
+
+std::string CompileServer::Handle(const std::string& request) {
+  ServerRequest req;
+  if (!ParseRequest(request, req)) {
+    MessageWriter response;
+    response.U32(0);
+    response.Str("ERROR: invalid compile server request\n");
+    response.Str("");
+    return response.Buf();
+  }
+  // Request is the cache key, so requests reading files of the host are
+  // neither cached nor shared.
+  if (!IsCacheable(req)) { return Execute(req); }
+
+  std::shared_future<std::string> response;
+  std::promise<std::string> promise;
+  std::string data;
+  bool compressed = false;
+  bool owner = false;
+  {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = cache.find(request);
+    if (it != cache.end()) {
+      if (it->second.size) {
+        lru.splice(lru.end(), lru, it->second.lru);
+        data = it->second.data;
+        compressed = it->second.compressed;
+      } else {
+        response = it->second.response;
+      }
+    } else {
+      CacheEntry& entry = cache[request];
+      entry.response = promise.get_future().share();
+      entry.compressed = false;
+      entry.size = 0;
+      response = entry.response;
+      owner = true;
+    }
+  }
+  if (!owner) {
+    if (response.valid()) { return response.get(); }
+    std::string result;
+    if (!compressed) { return data; }
+    if (Decompress(data, result)) { return result; }
+    return Execute(req);
+  }
+
+  std::string result = Execute(req);
+  promise.set_value(result);
+  uint32_t status = 0;
+  MessageReader(result).U32(status);
+  // Failures are not cached, as they may be caused by the environment.
+  if (status) { compressed = Compress(result, data); }
+  std::lock_guard<std::mutex> lock(m);
+  auto it = cache.find(request);
+  size_t size = request.size() + (compressed ? data.size() : result.size());
+  if (!status || size > cacheSize) {
+    cache.erase(it);
+  } else {
+    it->second.response = std::shared_future<std::string>();
+    it->second.data = compressed ? std::move(data) : result;
+    it->second.compressed = compressed;
+    it->second.size = size;
+    it->second.lru = lru.insert(lru.end(), &it->first);
+    cacheBytes += it->second.size;
+    Evict();
+  }
+  return result;
+}
+
+bool CompileServer::Compress(const std::string& response, std::string& compressed) {
+  std::unique_ptr<Compiler> c(CompilerFactory().CreateAMDGPUCompiler(llvmBin));
+  Buffer* output = c->NewBuffer(DT_INTERNAL);
+  if (!c->CompressArtifact(c->NewBufferReference(DT_INTERNAL, response.data(), response.size()), output)) { return false; }
+  compressed.assign(output->Ptr(), output->Size());
+  return compressed.size() < response.size();
+}
+
+bool CompileServer::Decompress(const std::string& compressed, std::string& response) {
+  std::unique_ptr<Compiler> c(CompilerFactory().CreateAMDGPUCompiler(llvmBin));
+  Buffer* output = c->NewBuffer(DT_INTERNAL);
+  if (!c->DecompressArtifact(c->NewBufferReference(DT_INTERNAL, compressed.data(), compressed.size()), output)) { return false; }
+  response.assign(output->Ptr(), output->Size());
+  return true;
+}
+
+void CompileServer::Evict() {
+  while (cacheBytes > cacheSize && !lru.empty()) {
+    auto it = cache.find(*lru.front());
+    lru.pop_front();
+    cacheBytes -= it->second.size;
+    cache.erase(it);
+  }
+}
+
+bool CompileServer::Accept(int client) {
+  // Clients running as other users could read sources and outputs of others
+  // through the cache.
+  if (IsSameUser(client)) {
+    if (++clients <= maxClients) { return true; }
+    --clients;
+  }
+  close(client);
+  return false;
+}
+
+void CompileServer::Serve(int client) {
+  std::string request;
+  while (ReceiveMessage(client, request)) {
+    if (!SendMessage(client, Handle(request))) { break; }
+  }
+  close(client);
+  --clients;
+}
+
+bool CompilerFactory::RunCompileServer(const std::string& llvmBin, const std::string& socketPath, size_t cacheSize) {
+  sockaddr_un addr;
+  if (!MakeAddress(socketPath, addr)) { return false; }
+  // Only a stale socket of an earlier server is replaced.
+  struct stat st;
+  if (lstat(socketPath.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) { return false; }
+    unlink(socketPath.c_str());
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) { return false; }
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return false;
+  }
+  struct stat bound;
+  if (lstat(socketPath.c_str(), &bound) != 0) {
+    close(fd);
+    return false;
+  }
+  // Server is never destroyed, as connection threads are detached.
+  CompileServer* server = new CompileServer(llvmBin, cacheSize);
+  for (;;) {
+    // Server stops when its socket is removed or replaced.
+    pollfd pfd = { fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, 200);
+    if (ready == 0) {
+      if (lstat(socketPath.c_str(), &st) != 0 || st.st_ino != bound.st_ino || st.st_dev != bound.st_dev) {
+        close(fd);
+        return true;
+      }
+      continue;
+    }
+    if (ready < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    int client = accept(fd, 0, 0);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) { continue; }
+      break;
+    }
+    if (!server->Accept(client)) { continue; }
+    std::thread(&CompileServer::Serve, server, client).detach();
+  }
+  close(fd);
+  return false;
+}
+
+#else // _WIN32
+
+bool CompilerFactory::RunCompileServer(const std::string& llvmBin, const std::string& socketPath, size_t cacheSize) {
+  return false;
+}
+
+#endif // _WIN32
+
+}
+}
@@ -1,7 +1,18 @@
 #include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
 #include "AmdCompiler.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/StringSaver.h"
 
 using namespace llvm;
 
@@ -25,6 +36,28 @@ Action(cl::desc("Action to perform:"),
 static cl::opt<std::string>
 LLVMBin("llvmbin", cl::desc("LLVM binary directory"));
 
+static cl::opt<std::string>
+BatchManifest("batch", cl::desc("Run jobs from manifest, one roc-cl command line per line"),
+              cl::value_desc("manifest"));
+
+static cl::opt<std::string>
+ServeSocket("serve", cl::desc("Run compile server listening on Unix domain socket"),
+            cl::value_desc("socket"));
+
+static cl::opt<std::string>
+ConnectSocket("connect", cl::desc("Compile with compile server listening on Unix domain socket"),
+              cl::value_desc("socket"));
+
+static cl::opt<unsigned>
+NumJobs("j", cl::desc("Number of jobs to run in parallel"),
+        cl::value_desc("N"), cl::init(1));
+
+static cl::opt<bool>
+PrintMetrics("metrics", cl::desc("Print compiler metrics in Prometheus text format after all jobs"));
+
+static cl::opt<bool>
+SeparateOutputs("separate", cl::desc("Compile each input into its own output, -o specifies output directory"));
+
 static cl::list<std::string>
 InputFilenames(cl::Positional, cl::desc("<input files>"),cl::ZeroOrMore);
 
@@ -38,48 +71,241 @@ OtherOptions(cl::Sink, cl::desc("<other options>"));
 using namespace amd::opencl_driver;
 using namespace llvm;
 
-int main(int argc, char* argv[])
+struct Job {
+  ActionType action;
+  std::vector<std::string> inputs;
+  std::string output;
+  std::vector<std::string> options;
+};
+
+// Job described by the options parsed last.
+static Job CurrentJob()
 {
-  cl::ParseCommandLineOptions(argc, argv, "AMD OpenCL Compiler");
+  Job job;
+  job.action = Action;
+  job.inputs = InputFilenames;
+  job.output = OutputFilename;
+  job.options = OtherOptions;
+  return job;
+}
 
+static Compiler* CreateCompiler(const std::string& llvmBin, const std::string& server)
+{
   CompilerFactory compilerFactory;
 
-  std::unique_ptr<Compiler> compiler(compilerFactory.CreateAMDGPUCompiler(LLVMBin));
+  if (!server.empty()) {
+    return compilerFactory.CreateRemoteCompiler(llvmBin, server);
+  }
+  return compilerFactory.CreateAMDGPUCompiler(llvmBin);
+}
 
+struct JobResult {
+  bool res = false;
+  double ms = 0;
+  std::string log;
+  // Errors of roc-cl itself, printed to stderr.
+  std::string errors;
+};
+
+static bool RunJob(Compiler* compiler, const Job& job, std::string& log, std::string& errors)
+{
   std::vector<Data*> inputs;
 
-  for (const std::string& inputFile : InputFilenames) {
+  for (const std::string& inputFile : job.inputs) {
     inputs.push_back(compiler->NewFileReference(DT_CL, inputFile));
   }
-  
-  std::vector<std::string> options = OtherOptions;
+
   Data* output;
 
   bool res;
 
-  switch (Action) {
+  switch (job.action) {
   case AC_NotSet:
   default:
-    errs() << "Error: action is not specified.\n"; res = false;
+    errors += "Error: action is not specified.\n"; res = false;
     break;
   case AC_CompileToLLVMBitcode:
-    output = compiler->NewFile(DT_LLVM_BC, OutputFilename);
-    res = compiler->CompileToLLVMBitcode(inputs, output, options);
+    output = compiler->NewFile(DT_LLVM_BC, job.output);
+    res = compiler->CompileToLLVMBitcode(inputs, output, job.options);
     break;
   case AC_LinkLLVMBitcode:
-    output = compiler->NewFile(DT_LLVM_BC, OutputFilename);
-    res = compiler->LinkLLVMBitcode(inputs, output, options);
+    output = compiler->NewFile(DT_LLVM_BC, job.output);
+    res = compiler->LinkLLVMBitcode(inputs, output, job.options);
     break;
   case AC_CompileAndLinkExecutable:
-    output = compiler->NewFile(DT_EXECUTABLE, OutputFilename);
-    res = compiler->CompileAndLinkExecutable(inputs, output, options);
+    output = compiler->NewFile(DT_EXECUTABLE, job.output);
+    res = compiler->CompileAndLinkExecutable(inputs, output, job.options);
     break;
   }
 
   std::string compilerOutput = compiler->Output();
   if (!compilerOutput.empty()) {
-    outs() << compilerOutput << '\n';
+    log += compilerOutput;
+    log += '\n';
+  }
+
+  return res;
+}
+
+// Each non-empty line of manifest, except comments starting with '#',
+// is parsed as roc-cl command line without program name.
+static bool ReadManifest(const std::string& manifest, std::vector<Job>& jobs)
+{
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFileOrSTDIN(manifest);
+  if (!buffer) {
+    errs() << "Error: cannot read manifest '" << manifest << "': " << buffer.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 64> lines;
+  (*buffer)->getBuffer().split(lines, '\n', -1, false);
+  unsigned lineNo = 0;
+  for (StringRef line : lines) {
+    ++lineNo;
+    line = line.trim();
+    if (line.empty() || line.startswith("#")) { continue; }
+    BumpPtrAllocator alloc;
+    StringSaver saver(alloc);
+    SmallVector<const char*, 32> argv;
+    argv.push_back("roc-cl");
+    cl::TokenizeGNUCommandLine(line, saver, argv);
+    cl::ResetAllOptionOccurrences();
+    std::string error;
+    raw_string_ostream errorOS(error);
+    if (!cl::ParseCommandLineOptions(argv.size(), argv.data(), "", &errorOS)) {
+      errs() << manifest << ":" << lineNo << ": " << errorOS.str();
+      return false;
+    }
+    if (!BatchManifest.empty()) {
+      errs() << manifest << ":" << lineNo << ": -batch is not allowed in manifest\n";
+      return false;
+    }
+    jobs.push_back(CurrentJob());
+  }
+  return true;
+}
+
+// Jobs with one input per job, output name is derived from input name.
+static void SeparateJobs(const Job& job, std::vector<Job>& jobs)
+{
+  const char* ext = job.action == AC_CompileAndLinkExecutable ? "co" : "bc";
+  for (const std::string& input : job.inputs) {
+    Job j = job;
+    j.inputs.assign(1, input);
+    SmallString<256> output(job.output);
+    sys::path::append(output, sys::path::filename(input));
+    sys::path::replace_extension(output, ext);
+    j.output = output.str().str();
+    jobs.push_back(j);
+  }
+}
+
+// Check that no two jobs write the same output, e.g. separate outputs of
+// inputs with the same file name in different directories.
+static bool CheckOutputs(const std::vector<Job>& jobs)
+{
+  std::map<std::string, size_t> outputs;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto it = outputs.insert(std::make_pair(jobs[i].output, i));
+    if (it.second) { continue; }
+    const Job& other = jobs[it.first->second];
+    errs() << "Error: output '" << jobs[i].output << "' of '"
+           << (jobs[i].inputs.empty() ? "" : jobs[i].inputs[0]) << "' is also output of '"
+           << (other.inputs.empty() ? "" : other.inputs[0]) << "'.\n";
+    return false;
+  }
+  return true;
+}
+
+// Run jobs on pool of numJobs workers, each with its own compiler.
+// Results are printed in order of jobs as soon as they are available.
+static int RunJobs(const std::vector<Job>& jobs, unsigned numJobs, const std::string& llvmBin, const std::string& server)
+{
+  typedef std::chrono::steady_clock clock;
+  clock::time_point batchStart = clock::now();
+  std::vector<JobResult> results(jobs.size());
+  std::vector<bool> done(jobs.size(), false);
+  std::mutex m;
+  std::condition_variable cv;
+  std::atomic_size_t next(0);
+
+  auto worker = [&]() {
+    std::unique_ptr<Compiler> compiler(CreateCompiler(llvmBin, server));
+    for (size_t i = next++; i < jobs.size(); i = next++) {
+      JobResult result;
+      clock::time_point start = clock::now();
+      result.res = RunJob(compiler.get(), jobs[i], result.log, result.errors);
+      result.ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+      std::lock_guard<std::mutex> lock(m);
+      results[i] = std::move(result);
+      done[i] = true;
+      cv.notify_one();
+    }
+  };
+
+  numJobs = std::max(1u, std::min<unsigned>(numJobs, jobs.size()));
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < numJobs; ++t) {
+    workers.emplace_back(worker);
+  }
+
+  unsigned failed = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [&]() { return done[i]; });
+    const JobResult& result = results[i];
+    if (!result.res) { ++failed; }
+    errs() << result.errors;
+    outs() << result.log;
+    outs() << "[" << (i + 1) << "/" << jobs.size() << "] "
+           << (result.res ? "OK    " : "FAILED") << format(" %10.1f ms ", result.ms) << jobs[i].output << "\n";
+    outs().flush();
+  }
+  for (std::thread& t : workers) { t.join(); }
+  double totalMs = std::chrono::duration<double, std::milli>(clock::now() - batchStart).count();
+  outs() << jobs.size() << " jobs, " << failed << " failed" << format(", %.1f ms total\n", totalMs);
+
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+  cl::ParseCommandLineOptions(argc, argv, "AMD OpenCL Compiler");
+
+  // Options are reparsed for each job in batch mode, so values are kept here.
+  std::string llvmBin = LLVMBin;
+  unsigned numJobs = NumJobs;
+  std::string server = ConnectSocket;
+  bool printMetrics = PrintMetrics;
+
+  if (!ServeSocket.empty()) {
+    CompilerFactory compilerFactory;
+    if (!compilerFactory.RunCompileServer(llvmBin, ServeSocket)) {
+      errs() << "Error: cannot serve on '" << ServeSocket << "'.\n";
+    }
+    return 1;
+  }
+
+  std::vector<Job> jobs;
+  if (!BatchManifest.empty()) {
+    std::string manifest = BatchManifest;
+    if (!ReadManifest(manifest, jobs)) { return 1; }
+  } else if (SeparateOutputs) {
+    SeparateJobs(CurrentJob(), jobs);
+  } else {
+    std::unique_ptr<Compiler> compiler(CreateCompiler(llvmBin, server));
+    // Process exits after single job, so its memory is not freed.
+    compiler->SetFastTeardown(true);
+
+    std::string log, errors;
+    bool res = RunJob(compiler.get(), CurrentJob(), log, errors);
+    errs() << errors;
+    outs() << log;
+    if (printMetrics) { outs() << CompilerFactory().GetMetrics().ToPrometheus(); }
+    return res ? 0 : 1;
   }
 
-  return res ? 0 : 1;
+  if (!CheckOutputs(jobs)) { return 1; }
+  int res = RunJobs(jobs, numJobs, llvmBin, server);
+  if (printMetrics) { outs() << CompilerFactory().GetMetrics().ToPrometheus(); }
+  return res;
 }
@@ -1,4 +1,11 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
 #include "gtest/gtest.h"
 #include "AmdCompiler.h"
 
@@ -111,6 +118,27 @@ static const char* defined =
 "}                                                     \n"
 ;
 
+static const char* twoKernels =
+"kernel void test_kernel(global int* out)              \n"
+"{                                                     \n"
+"  out[0] = 4;                                         \n"
+"}                                                     \n"
+"                                                      \n"
+"kernel void unused_kernel(global int* out)            \n"
+"{                                                     \n"
+"  out[0] = 5;                                         \n"
+"}                                                     \n"
+;
+
+static const char* simpleAssembly =
+"  .text                                               \n"
+"  .globl test_function                                \n"
+"  .p2align 8                                          \n"
+"  .type test_function,@function                       \n"
+"test_function:                                        \n"
+"  s_endpgm                                            \n"
+;
+
 static const char* invalidCL =
 "kernel void test() { ExpectedErrorInCLSource; }       \n"
 ;
@@ -124,6 +152,16 @@ TEST_F(AMDGPUCompilerTest, OutputEmpty)
   EXPECT_EQ(compiler->Output().length(), 0U);
 }
 
+TEST_F(AMDGPUCompilerTest, NewTempFile_Exists)
+{
+  File* dir = compiler->NewTempDir();
+  ASSERT_NE(dir, nullptr);
+  File* f = compiler->NewTempFile(DT_CL, "t.cl", dir);
+  ASSERT_NE(f, nullptr);
+  EXPECT_TRUE(f->Exists());
+  EXPECT_EQ(compiler->NewTempFile(DT_CL, "t.cl", dir), nullptr);
+}
+
 TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_File_To_File)
 {
   FileReference* f = TestDirInputFile(DT_CL, simpleCl);
@@ -148,6 +186,22 @@ TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_Buffer_To_Buffer)
   ASSERT_TRUE(!out->IsEmpty());
 }
 
+TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_SourceFails)
+{
+  // Failing source fails the call, with frontends run one after another
+  // or in parallel.
+  for (unsigned jobs : { 1u, 0u }) {
+    compiler->SetParallelJobs(jobs);
+    std::vector<Data*> inputs;
+    inputs.push_back(NewClSource(simpleSource));
+    inputs.push_back(NewClSource(invalidCL));
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    ASSERT_NE(out, nullptr);
+    EXPECT_FALSE(compiler->CompileToLLVMBitcode(inputs, out, defaultOptions));
+    EXPECT_NE(compiler->Output().find("ExpectedErrorInCLSource"), std::string::npos);
+  }
+}
+
 TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_Include_I1)
 {
   Data* src = NewClSource(includer);
@@ -201,6 +255,205 @@ TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_Buffer_To_Buffer)
   ASSERT_TRUE(!out->IsEmpty());
 }
 
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_CrashRecovery)
+{
+  // Jobs run under crash recovery on their own threads.
+  compiler->SetInProcess(true);
+  compiler->SetCrashRecovery(true);
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  ASSERT_TRUE(!out->IsEmpty());
+}
+
+#ifndef NDEBUG
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_CrashRecoveryCrash)
+{
+  // Crashed job fails the call instead of aborting the process.
+  compiler->SetInProcess(true);
+  compiler->SetCrashRecovery(true);
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  std::vector<std::string> options(defaultOptions);
+  options.push_back("-mllvm");
+  options.push_back("-amd-ocl-crash-job");
+  EXPECT_FALSE(compiler->CompileAndLinkExecutable(inputs, out, options));
+  EXPECT_NE(compiler->Output().find("crashed"), std::string::npos);
+  // Later compilations are not affected.
+  Buffer* out2 = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out2, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out2, defaultOptions));
+  ASSERT_TRUE(!out2->IsEmpty());
+}
+#endif // NDEBUG
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_WarmUp)
+{
+  // Compilation runs concurrently with warm-up running in background.
+  compiler->WarmUp(std::vector<std::string>(), defaultOptions);
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  ASSERT_TRUE(!out->IsEmpty());
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_WarmUpTargets)
+{
+  // Warm-up compiles for each target, waited for by its calls in metrics.
+  CompilerMetrics before = compilerFactory.GetMetrics();
+  std::vector<std::string> targets;
+  targets.push_back("gfx803");
+  targets.push_back("gfx900");
+  compiler->WarmUp(targets, defaultOptions);
+  CompilerMetrics after;
+  for (int i = 0; i < 6000; ++i) {
+    after = compilerFactory.GetMetrics();
+    if (after.calls["CompileAndLinkExecutable"] >= before.calls["CompileAndLinkExecutable"] + targets.size()) { break; }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(after.calls["CompileAndLinkExecutable"], before.calls["CompileAndLinkExecutable"] + targets.size());
+  EXPECT_EQ(after.failures["CompileAndLinkExecutable"], before.failures["CompileAndLinkExecutable"]);
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_Timeout)
+{
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  compiler->SetTimeout(1);
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  EXPECT_FALSE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  EXPECT_NE(compiler->Output().find("timed out"), std::string::npos);
+
+  compiler->SetTimeout(0);
+  out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_SameOptions_DifferentInputs)
+{
+  // Second compilation reuses jobs planned for the first one.
+  compiler->SetInProcess(true);
+  Data* src1 = NewClSource(simpleSource);
+  ASSERT_NE(src1, nullptr);
+  Data* src2 = NewClSource(twoKernels);
+  ASSERT_NE(src2, nullptr);
+  Buffer* out1 = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out1, nullptr);
+  Buffer* out2 = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out2, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src1);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out1, defaultOptions));
+  inputs.clear();
+  inputs.push_back(src2);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out2, defaultOptions));
+  std::string exec1(out1->Ptr(), out1->Size());
+  std::string exec2(out2->Ptr(), out2->Size());
+  ASSERT_EQ(exec1.find("unused_kernel"), std::string::npos);
+  ASSERT_NE(exec2.find("unused_kernel"), std::string::npos);
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutables_Buffer_To_Buffers)
+{
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  std::vector<std::string> targets;
+  targets.push_back("gfx803");
+  targets.push_back("gfx900");
+  std::vector<Data*> outputs;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    ASSERT_NE(out, nullptr);
+    outputs.push_back(out);
+  }
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutables(inputs, targets, outputs, defaultOptions));
+  for (Data* out : outputs) {
+    ASSERT_TRUE(!static_cast<Buffer*>(out)->IsEmpty());
+  }
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutables_ParallelJobs)
+{
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  std::vector<std::string> targets;
+  targets.push_back("gfx803");
+  targets.push_back("gfx900");
+  targets.push_back("gfx906");
+  std::vector<Data*> outputs;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    ASSERT_NE(out, nullptr);
+    outputs.push_back(out);
+  }
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  // Targets of in-process compiler run in parallel in child processes.
+  compiler->SetInProcess(true);
+  compiler->SetParallelJobs(0);
+  CompilerMetrics before = compilerFactory.GetMetrics();
+  ASSERT_TRUE(compiler->CompileAndLinkExecutables(inputs, targets, outputs, defaultOptions));
+  CompilerMetrics after = compilerFactory.GetMetrics();
+  EXPECT_GE(after.childProcesses, before.childProcesses + targets.size());
+  for (Data* out : outputs) {
+    ASSERT_TRUE(!static_cast<Buffer*>(out)->IsEmpty());
+  }
+  // Without parallel jobs, targets run in process one after another.
+  compiler->SetParallelJobs(1);
+  before = compilerFactory.GetMetrics();
+  ASSERT_TRUE(compiler->CompileAndLinkExecutables(inputs, targets, outputs, defaultOptions));
+  after = compilerFactory.GetMetrics();
+  EXPECT_EQ(after.childProcesses, before.childProcesses);
+  outputs.pop_back();
+  EXPECT_FALSE(compiler->CompileAndLinkExecutables(inputs, targets, outputs, defaultOptions));
+  EXPECT_NE(compiler->Output().find("number of targets"), std::string::npos);
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_Assembly_Buffer_To_Buffer)
+{
+  // In-process assembler reads the buffer directly, so the call creates
+  // no more temp files than for assembly already in a file.
+  compiler->SetInProcess(true);
+  File* srcFile = compiler->NewTempFile(DT_ASSEMBLY);
+  ASSERT_NE(srcFile, nullptr);
+  ASSERT_TRUE(srcFile->WriteData(simpleAssembly, strlen(simpleAssembly)));
+  std::vector<std::string> options;
+  options.push_back("-mcpu=gfx900");
+  Buffer* fileOut = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(fileOut, nullptr);
+  CompilerMetrics before = compilerFactory.GetMetrics();
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(std::vector<Data*>(1, srcFile), fileOut, options));
+  uint64_t fileTempFiles = compilerFactory.GetMetrics().tempFiles - before.tempFiles;
+  Data* src = compiler->NewBufferReference(DT_ASSEMBLY, simpleAssembly, strlen(simpleAssembly));
+  ASSERT_NE(src, nullptr);
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  before = compilerFactory.GetMetrics();
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, options));
+  EXPECT_EQ(compilerFactory.GetMetrics().tempFiles - before.tempFiles, fileTempFiles);
+  ASSERT_TRUE(!out->IsEmpty());
+}
+
 TEST_F(AMDGPUCompilerTest, CompileAndLink_CLs_File_To_File)
 {
   std::vector<Data*> inputs;
@@ -295,6 +548,53 @@ TEST_F(AMDGPUCompilerTest, LinkLLVMBitcode_Buffer_To_Buffer)
   ASSERT_TRUE(!out->IsEmpty());
 }
 
+TEST_F(AMDGPUCompilerTest, LinkLLVMBitcode_ResidentLibraries)
+{
+  compiler->SetResidentLibraries(true);
+  std::vector<Data*> inputs;
+  Data* src1 = NewClSource(externFunction1);
+  ASSERT_NE(src1, nullptr);
+  Data* src2 = NewClSource(externFunction2);
+  ASSERT_NE(src2, nullptr);
+  for (Data* src : { src1, src2 }) {
+    std::vector<Data*> srcs(1, src);
+    Buffer* bc = compiler->NewBuffer(DT_LLVM_BC);
+    ASSERT_NE(bc, nullptr);
+    ASSERT_TRUE(compiler->CompileToLLVMBitcode(srcs, bc, defaultOptions));
+    inputs.push_back(bc);
+  }
+
+  // Output of link without pooled context.
+  std::unique_ptr<Compiler> unpooled(compilerFactory.CreateAMDGPUCompiler(llvmBin));
+  Buffer* expected = unpooled->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(expected, nullptr);
+  ASSERT_TRUE(unpooled->LinkLLVMBitcode(inputs, expected, emptyOptions));
+  ASSERT_TRUE(!expected->IsEmpty());
+
+  // Inputs are loaded on the first link and resident on the next ones.
+  for (unsigned i = 0; i < 3; ++i) {
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    ASSERT_NE(out, nullptr);
+    ASSERT_TRUE(compiler->LinkLLVMBitcode(inputs, out, emptyOptions));
+    EXPECT_EQ(std::string(out->Ptr(), out->Size()), std::string(expected->Ptr(), expected->Size()));
+  }
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkExecutable_LinkTimeOptimization)
+{
+  // Function of the other source is inlined into the kernel and removed.
+  compiler->SetLinkTimeOptimization(true);
+  std::vector<Data*> inputs;
+  inputs.push_back(NewClSource(externFunction1));
+  inputs.push_back(NewClSource(externFunction2));
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  std::string exec(out->Ptr(), out->Size());
+  EXPECT_NE(exec.find("test_kernel"), std::string::npos);
+  EXPECT_EQ(exec.find("test_function"), std::string::npos);
+}
+
 TEST_F(AMDGPUCompilerTest, CompileAndLink_BCs_File_To_File)
 {
   std::vector<Data*> inputs;
@@ -456,6 +756,24 @@ TEST_F(AMDGPUCompilerTest, CompileAndLink_EmbeddedIncludeOverride)
   ASSERT_TRUE(!out->IsEmpty());
 }
 
+TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_EmbeddedIncludeShared)
+{
+  // Identical embedded headers are served from the same in-memory set.
+  for (int i = 0; i < 2; ++i) {
+    CompilerMetrics before = compilerFactory.GetMetrics();
+    std::vector<Data*> inputs;
+    inputs.push_back(NewClSource(includer));
+    inputs.push_back(compiler->NewBufferReference(DT_CL_HEADER, include, strlen(include), "include.h"));
+    Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+    ASSERT_TRUE(compiler->CompileToLLVMBitcode(inputs, out, defaultOptions));
+    ASSERT_TRUE(!out->IsEmpty());
+    if (i > 0 && compiler->IsInProcess()) {
+      CompilerMetrics after = compilerFactory.GetMetrics();
+      EXPECT_EQ(after.cacheHits["header_sets"], before.cacheHits["header_sets"] + 1);
+    }
+  }
+}
+
 TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_Define1)
 {
   Data* src = compiler->NewBufferReference(DT_CL, defined, strlen(defined));
@@ -514,6 +832,165 @@ TEST_F(AMDGPUCompilerTest, CompileAndLink_Define2)
   ASSERT_TRUE(!out->IsEmpty());
 }
 
+TEST_F(AMDGPUCompilerTest, SpecializeLLVMBitcode_Define)
+{
+  Data* src = compiler->NewBufferReference(DT_CL, defined, strlen(defined));
+  ASSERT_NE(src, nullptr);
+  Buffer* generic = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(generic, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  std::vector<std::string> placeholders;
+  placeholders.push_back("DEF");
+  ASSERT_TRUE(compiler->CompileToSpecializableLLVMBitcode(inputs, generic, placeholders, defaultOptions));
+  ASSERT_TRUE(!generic->IsEmpty());
+
+  inputs.clear();
+  inputs.push_back(generic);
+  std::vector<std::string> options(defaultOptions);
+  options.push_back("-O3");
+  // Values are literals in code, printed in hex by disassembler.
+  const char* values[][2] = { { "DEF=74565", "0x12345" }, { "DEF=344865", "0x54321" } };
+  for (size_t i = 0; i < 2; ++i) {
+    Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+    ASSERT_NE(out, nullptr);
+    std::vector<std::string> specValues;
+    specValues.push_back(values[i][0]);
+    ASSERT_TRUE(compiler->SpecializeLLVMBitcode(inputs, out, specValues, options));
+    ASSERT_TRUE(!out->IsEmpty());
+    File* dump = compiler->NewTempFile(DT_INTERNAL, "spec" + std::to_string(i) + ".s");
+    ASSERT_NE(dump, nullptr);
+    ASSERT_TRUE(compiler->DumpExecutableAsText(out, dump));
+    std::ifstream in(dump->Name());
+    std::stringstream text;
+    text << in.rdbuf();
+    EXPECT_NE(text.str().find(values[i][1]), std::string::npos);
+    EXPECT_EQ(text.str().find(values[1 - i][1]), std::string::npos);
+  }
+}
+
+TEST_F(AMDGPUCompilerTest, SpecializeLLVMBitcode_Error_NoValue)
+{
+  Data* src = compiler->NewBufferReference(DT_CL, defined, strlen(defined));
+  ASSERT_NE(src, nullptr);
+  Buffer* generic = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(generic, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  std::vector<std::string> placeholders;
+  placeholders.push_back("DEF");
+  ASSERT_TRUE(compiler->CompileToSpecializableLLVMBitcode(inputs, generic, placeholders, defaultOptions));
+
+  inputs.clear();
+  inputs.push_back(generic);
+  Buffer* out = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(out, nullptr);
+  std::vector<std::string> values;
+  ASSERT_FALSE(compiler->SpecializeLLVMBitcode(inputs, out, values, defaultOptions));
+  ASSERT_TRUE(out->IsEmpty());
+}
+
+TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_Compact)
+{
+  Data* src = NewClSource(externFunction1);
+  ASSERT_NE(src, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  std::vector<std::string> options(defaultOptions);
+  options.push_back("-g");
+  Buffer* bc = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(bc, nullptr);
+  ASSERT_TRUE(compiler->CompileToLLVMBitcode(inputs, bc, options));
+
+  compiler->SetCompactBitcode(true);
+  Buffer* compactBc = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(compactBc, nullptr);
+  ASSERT_TRUE(compiler->CompileToLLVMBitcode(inputs, compactBc, options));
+  ASSERT_LT(compactBc->Size(), bc->Size());
+  std::string compact(compactBc->Ptr(), compactBc->Size());
+  ASSERT_NE(compact.find("test_kernel"), std::string::npos);
+
+  // Compact bitcode still links with bitcode defining used function.
+  compiler->SetCompactBitcode(false);
+  inputs.clear();
+  inputs.push_back(compactBc);
+  inputs.push_back(NewClSource(externFunction2));
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  ASSERT_TRUE(!out->IsEmpty());
+}
+
+TEST_F(AMDGPUCompilerTest, CompressArtifact_Roundtrip)
+{
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  Buffer* exec = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(exec, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, exec, defaultOptions));
+
+  File* compressed = TmpOutputFile(DT_INTERNAL);
+  ASSERT_NE(compressed, nullptr);
+  ASSERT_TRUE(compiler->CompressArtifact(exec, compressed));
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_TRUE(compiler->DecompressArtifact(compressed, out));
+  ASSERT_EQ(out->Buf(), exec->Buf());
+
+  // Type must match the type of compressed data.
+  Buffer* bc = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_FALSE(compiler->DecompressArtifact(compressed, bc));
+  ASSERT_FALSE(compiler->DecompressArtifact(exec, out));
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkKernels_Subset)
+{
+  Data* src = NewClSource(twoKernels);
+  ASSERT_NE(src, nullptr);
+  Buffer* bc = compiler->NewBuffer(DT_LLVM_BC);
+  ASSERT_NE(bc, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  ASSERT_TRUE(compiler->CompileToLLVMBitcode(inputs, bc, defaultOptions));
+
+  inputs.clear();
+  inputs.push_back(bc);
+  std::vector<std::string> kernels;
+  kernels.push_back("test_kernel");
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkKernels(inputs, out, kernels, defaultOptions));
+  ASSERT_TRUE(!out->IsEmpty());
+  std::string exec(out->Ptr(), out->Size());
+  ASSERT_NE(exec.find("test_kernel"), std::string::npos);
+  ASSERT_EQ(exec.find("unused_kernel"), std::string::npos);
+
+  // Add the other kernel later into a new executable.
+  kernels.clear();
+  kernels.push_back("unused_kernel");
+  Buffer* out2 = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out2, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkKernels(inputs, out2, kernels, defaultOptions));
+  std::string exec2(out2->Ptr(), out2->Size());
+  ASSERT_NE(exec2.find("unused_kernel"), std::string::npos);
+}
+
+TEST_F(AMDGPUCompilerTest, CompileAndLinkKernels_Error_UnknownKernel)
+{
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  std::vector<std::string> kernels;
+  kernels.push_back("no_such_kernel");
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_FALSE(compiler->CompileAndLinkKernels(inputs, out, kernels, defaultOptions));
+  ASSERT_TRUE(out->IsEmpty());
+}
+
 TEST_F(AMDGPUCompilerTest, CompileToLLVMBitcode_Error_InvalidCL)
 {
   Data* src = compiler->NewBufferReference(DT_CL, invalidCL, strlen(invalidCL));
@@ -553,3 +1030,141 @@ TEST_F(AMDGPUCompilerTest, LinkLLVMBitcode_Error_InvalidBC)
   ASSERT_TRUE(out->IsEmpty());
   ASSERT_TRUE(!compiler->Output().empty());
 }
+
+TEST_F(AMDGPUCompilerTest, RemoteCompiler_NoServer_CompilesLocally)
+{
+  std::unique_ptr<Compiler> remote(compilerFactory.CreateRemoteCompiler(llvmBin, "/nonexistent/roc-cl.sock"));
+  Data* src = remote->NewBufferReference(DT_CL, simpleSource, strlen(simpleSource));
+  ASSERT_NE(src, nullptr);
+  Buffer* out = remote->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  ASSERT_TRUE(remote->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  ASSERT_TRUE(!out->IsEmpty());
+}
+
+TEST_F(AMDGPUCompilerTest, Statistics_MemoryBudget)
+{
+  Data* src = NewClSource(simpleSource);
+  ASSERT_NE(src, nullptr);
+  std::vector<Data*> inputs;
+  inputs.push_back(src);
+  Buffer* out = compiler->NewBuffer(DT_EXECUTABLE);
+  ASSERT_NE(out, nullptr);
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, out, defaultOptions));
+  EXPECT_GT(compiler->Statistics().wallTime, 0);
+
+  // Budget smaller than any compilation still admits them one at a time.
+  compilerFactory.SetMemoryBudget(1);
+  std::vector<std::thread> threads;
+  std::vector<char> results(4, 0);
+  for (size_t i = 0; i < results.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      std::unique_ptr<Compiler> c(compilerFactory.CreateAMDGPUCompiler(llvmBin));
+      std::vector<Data*> cinputs(1, c->NewBufferReference(DT_CL, simpleSource, strlen(simpleSource)));
+      results[i] = c->CompileToLLVMBitcode(cinputs, c->NewBuffer(DT_LLVM_BC), defaultOptions);
+    });
+  }
+  for (std::thread& t : threads) { t.join(); }
+  compilerFactory.SetMemoryBudget(0);
+  for (char res : results) { EXPECT_TRUE(res); }
+}
+
+TEST_F(AMDGPUCompilerTest, Statistics_Priority)
+{
+  // With one slot, compilations run one at a time in order of priority.
+  // Interactive compilation arriving after background ones are queued
+  // runs before them.
+  compilerFactory.SetMaxCompilations(1);
+  std::vector<std::thread> threads;
+  std::vector<char> results(4, 0);
+  std::vector<CompileStatistics> stats(results.size());
+  std::vector<unsigned> order(results.size(), 0);
+  std::atomic_uint finished(0);
+  const size_t interactive = results.size() - 1;
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (i == interactive) { std::this_thread::sleep_for(std::chrono::milliseconds(50)); }
+    threads.emplace_back([&, i]() {
+      std::unique_ptr<Compiler> c(compilerFactory.CreateAMDGPUCompiler(llvmBin));
+      c->SetPriority(i == interactive ? CP_INTERACTIVE : CP_BACKGROUND);
+      std::vector<Data*> cinputs(1, c->NewBufferReference(DT_CL, simpleSource, strlen(simpleSource)));
+      results[i] = c->CompileAndLinkExecutable(cinputs, c->NewBuffer(DT_EXECUTABLE), defaultOptions);
+      order[i] = finished++;
+      stats[i] = c->Statistics();
+    });
+  }
+  for (std::thread& t : threads) { t.join(); }
+  compilerFactory.SetMaxCompilations(0);
+  double maxBackgroundQueueTime = 0;
+  for (size_t i = 0; i < results.size(); ++i) {
+    EXPECT_TRUE(results[i]);
+    EXPECT_GE(stats[i].queueTime, 0);
+    EXPECT_GT(stats[i].compileTime, 0);
+    EXPECT_LE(stats[i].compileTime, stats[i].wallTime);
+    if (i != interactive && stats[i].queueTime > maxBackgroundQueueTime) {
+      maxBackgroundQueueTime = stats[i].queueTime;
+    }
+  }
+  // Only the background compilation running when it arrived may finish first.
+  EXPECT_LE(order[interactive], 1u);
+  EXPECT_LT(stats[interactive].queueTime, maxBackgroundQueueTime);
+}
+
+TEST_F(AMDGPUCompilerTest, Metrics_Snapshot)
+{
+  CompilerMetrics before = compilerFactory.GetMetrics();
+  std::vector<Data*> inputs(1, compiler->NewBufferReference(DT_CL, simpleSource, strlen(simpleSource)));
+  ASSERT_TRUE(compiler->CompileAndLinkExecutable(inputs, compiler->NewBuffer(DT_EXECUTABLE), defaultOptions));
+  CompilerMetrics after = compilerFactory.GetMetrics();
+  EXPECT_EQ(after.calls["CompileAndLinkExecutable"], before.calls["CompileAndLinkExecutable"] + 1);
+  EXPECT_EQ(after.failures["CompileAndLinkExecutable"], before.failures["CompileAndLinkExecutable"]);
+  EXPECT_EQ(after.bytesIn, before.bytesIn + strlen(simpleSource));
+  EXPECT_GT(after.bytesOut, before.bytesOut);
+  const LatencyHistogram& latency = after.callLatency["CompileAndLinkExecutable"];
+  EXPECT_GT(latency.count, 0u);
+  EXPECT_LE(latency.Quantile(0.5), latency.Quantile(0.99));
+  EXPECT_LE(latency.Quantile(0.99), latency.max);
+  std::string text = after.ToPrometheus();
+  EXPECT_NE(text.find("amd_ocl_calls_total{api=\"CompileAndLinkExecutable\",result=\"success\"}"), std::string::npos);
+  EXPECT_NE(text.find("amd_ocl_phase_latency_ms_bucket"), std::string::npos);
+  EXPECT_NE(text.find("# TYPE amd_ocl_call_latency_ms_max gauge"), std::string::npos);
+  EXPECT_EQ(text.find("_quantile"), std::string::npos);
+}
+
+TEST_F(AMDGPUCompilerTest, RemoteCompiler_Server)
+{
+  std::string socketPath = "/tmp/roc-cl-unittest-" + std::to_string(getpid()) + ".sock";
+  std::string bin = llvmBin;
+  // Server stops when its socket is removed.
+  std::thread server([bin, socketPath]() {
+    CompilerFactory factory;
+    EXPECT_TRUE(factory.RunCompileServer(bin, socketPath));
+  });
+  struct StopServer {
+    const std::string& path;
+    std::thread& server;
+    ~StopServer() { unlink(path.c_str()); server.join(); }
+  } stop = { socketPath, server };
+  for (int i = 0; i < 100 && access(socketPath.c_str(), F_OK) != 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::unique_ptr<Compiler> remote(compilerFactory.CreateRemoteCompiler(llvmBin, socketPath));
+  std::vector<Data*> inputs;
+  inputs.push_back(remote->NewBufferReference(DT_CL, simpleSource, strlen(simpleSource)));
+  // Second request is served from the cache.
+  for (int i = 0; i < 2; ++i) {
+    Buffer* out = remote->NewBuffer(DT_EXECUTABLE);
+    ASSERT_NE(out, nullptr);
+    ASSERT_TRUE(remote->CompileAndLinkExecutable(inputs, out, defaultOptions));
+    ASSERT_TRUE(!out->IsEmpty());
+    EXPECT_TRUE(remote->Statistics().remote);
+  }
+  Buffer* out = remote->NewBuffer(DT_LLVM_BC);
+  inputs.clear();
+  inputs.push_back(remote->NewBufferReference(DT_CL, invalidCL, strlen(invalidCL)));
+  ASSERT_FALSE(remote->CompileToLLVMBitcode(inputs, out, defaultOptions));
+  ASSERT_TRUE(out->IsEmpty());
+  ASSERT_TRUE(!remote->Output().empty());
+  EXPECT_TRUE(remote->Statistics().remote);
+}